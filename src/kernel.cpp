@@ -8,8 +8,7 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 	const int gd3 = 3 * gds;
 	const int gd4 = 4 * gds;
 
-	const int* const act = shared;
-	const int* const beg = &act[nf];
+	const int* const beg = &shared[nf]; // Skip the act flags, which are all set because normalization folds frames of no effective torsion.
 	const int* const end = &beg[nf];
 	const int* const nbr = &end[nf];
 	const int* const prn = &nbr[nf];
@@ -49,34 +48,31 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 		y1 = c[i0 += gds];
 		y2 = c[i0 += gds];
 
-		// Translate orientation of active frames from quaternion into 3x3 matrix.
-		if (act[k])
-		{
-			q0 = q[k0  = k * gd4 + gid];
-			q1 = q[k0 += gds];
-			q2 = q[k0 += gds];
-			q3 = q[k0 += gds];
-			assert(fabs(q0*q0 + q1*q1 + q2*q2 + q3*q3 - 1.0f) < 2e-3f);
-			q00 = q0 * q0;
-			q01 = q0 * q1;
-			q02 = q0 * q2;
-			q03 = q0 * q3;
-			q11 = q1 * q1;
-			q12 = q1 * q2;
-			q13 = q1 * q3;
-			q22 = q2 * q2;
-			q23 = q2 * q3;
-			q33 = q3 * q3;
-			m0 = q00 + q11 - q22 - q33;
-			m1 = 2 * (q12 - q03);
-			m2 = 2 * (q02 + q13);
-			m3 = 2 * (q03 + q12);
-			m4 = q00 - q11 + q22 - q33;
-			m5 = 2 * (q23 - q01);
-			m6 = 2 * (q13 - q02);
-			m7 = 2 * (q01 + q23);
-			m8 = q00 - q11 - q22 + q33;
-		}
+		// Translate orientation from quaternion into 3x3 matrix.
+		q0 = q[k0  = k * gd4 + gid];
+		q1 = q[k0 += gds];
+		q2 = q[k0 += gds];
+		q3 = q[k0 += gds];
+		assert(fabs(q0*q0 + q1*q1 + q2*q2 + q3*q3 - 1.0f) < 2e-3f);
+		q00 = q0 * q0;
+		q01 = q0 * q1;
+		q02 = q0 * q2;
+		q03 = q0 * q3;
+		q11 = q1 * q1;
+		q12 = q1 * q2;
+		q13 = q1 * q3;
+		q22 = q2 * q2;
+		q23 = q2 * q3;
+		q33 = q3 * q3;
+		m0 = q00 + q11 - q22 - q33;
+		m1 = 2 * (q12 - q03);
+		m2 = 2 * (q02 + q13);
+		m3 = 2 * (q03 + q12);
+		m4 = q00 - q11 + q22 - q33;
+		m5 = 2 * (q23 - q01);
+		m6 = 2 * (q13 - q02);
+		m7 = 2 * (q01 + q23);
+		m8 = q00 - q11 - q22 + q33;
 
 		// Evaluate c and d of frame atoms. Aggregate e into y.
 		for (i = beg[k], z = end[k]; i < z; ++i)
@@ -149,9 +145,6 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 			c[i1] = y1 + m3 * yy0[i] + m4 * yy1[i] + m5 * yy2[i];
 			c[i2] = y2 + m6 * yy0[i] + m7 * yy1[i] + m8 * yy2[i];
 
-			// Skip inactive BRANCH frame
-			if (!act[i]) continue;
-
 			// Update a of BRANCH frame
 			a0 = m0 * xy0[i] + m1 * xy1[i] + m2 * xy2[i];
 			a1 = m3 * xy0[i] + m4 * xy1[i] + m5 * xy2[i];
@@ -213,12 +206,12 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 		}
 	}
 
+	// Store e from register into memory, so that the line search can interpolate a refused trial.
+	e[gid] = y;
+
 	// If the free energy is no better than the upper bound, refuse this conformation.
 	if (y >= eub) return false;
 
-	// Store e from register into memory.
-	e[gid] = y;
-
 	// Calculate and aggregate the force and torque of BRANCH frames to their parent frame.
 	f[k0 = gid] = 0.0f;
 	t[k0] = 0.0f;
@@ -277,11 +270,8 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 
 		if (k)
 		{
-			// Save the aggregated torque of active BRANCH frames to g.
-			if (act[k])
-			{
-				g[w -= gds] = t0 * a[k0] + t1 * a[k1] + t2 * a[k2]; // dot product
-			}
+			// Save the aggregated torque of BRANCH frames to g.
+			g[w -= gds] = t0 * a[k0] + t1 * a[k1] + t2 * a[k2]; // dot product
 
 			// Aggregate the force and torque of current frame to its parent frame.
 			k0 = prn[k] * gd3 + gid;
@@ -310,7 +300,7 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 	return true;
 }
 
-void monte_carlo(float* const s0e, const int* const lig, const int nv, const int nf, const int na, const int np, const int seed, const int nbi, const float* const sfe, const float* const sfd, const int sfs, const array<float, 3> cr0, const array<float, 3> cr1, const array<int, 3> npr, const float gri, const vector<vector<float>>& mps, const int gid, const int gds)
+int monte_carlo(float* const s0e, const int* const lig, const evaluator evl, const int nv, const int nf, const int na, const int np, const int seed, const float* const org, const int nbi, const float hdm, const bool hsc, const bool lsi, const float* const sfe, const float* const sfd, const int sfs, const array<float, 3> cr0, const array<float, 3> cr1, const array<int, 3> npr, const float gri, const vector<vector<float>>& mps, const int gid, const int gds)
 {
 	const int nls = 5; // Number of line search trials for determining step size in BFGS
 	const float eub = 40.0f * na; // A conformation will be droped if its free energy is not better than e_upper_bound.
@@ -346,32 +336,49 @@ void monte_carlo(float* const s0e, const int* const lig, const int nv, const int
 	float* const bfm = &bfy[nv * gds];
 	float rd0, rd1, rd2, rd3, rst;
 	float sum, pg1, pga, pgc, alp, pg2, pr0, pr1, pr2, nrm, ang, sng, pq0, pq1, pq2, pq3, s1xq0, s1xq1, s1xq2, s1xq3, s2xq0, s2xq1, s2xq2, s2xq3, bpi;
-	float yhy, yps, ryp, pco, bpj, bmj, ppj;
-	int g, i, j, o0, o1, o2;
+	float yhy, yps, ryp, pco, bpj, bmj, ppj, yty, hsf, alo, elo, plo, ahi, ehi, dal;
+	int g, i, j, o0, o1, o2, ini, nev;
 	mt19937_64 rng(seed);
 	uniform_real_distribution<double> uniform_01(0, 1);
 
-	// Randomize s0x.
-	rd0 = uniform_01(rng);
-	s0x[o0  = gid] = rd0 * cr1[0] + (1 - rd0) * cr0[0];
-	rd0 = uniform_01(rng);
-	s0x[o0 += gds] = rd0 * cr1[1] + (1 - rd0) * cr0[1];
-	rd0 = uniform_01(rng);
-	s0x[o0 += gds] = rd0 * cr1[2] + (1 - rd0) * cr0[2];
-	rd0 = uniform_01(rng);
-	rd1 = uniform_01(rng);
-	rd2 = uniform_01(rng);
-	rd3 = uniform_01(rng);
-	rst = 1 / sqrt(rd0*rd0 + rd1*rd1 + rd2*rd2 + rd3*rd3);
-	s0x[o0 += gds] = rd0 * rst;
-	s0x[o0 += gds] = rd1 * rst;
-	s0x[o0 += gds] = rd2 * rst;
-	s0x[o0 += gds] = rd3 * rst;
-	for (i = 6; i < nv; ++i)
+	// Randomize s0x, unless a pose of the ROOT frame is given, in which case the torsions are kept at their input values.
+	if (org)
+	{
+		s0x[o0  = gid] = org[0];
+		for (i = 1; i < 7; ++i)
+		{
+			s0x[o0 += gds] = org[i];
+		}
+		for (i = 6; i < nv; ++i)
+		{
+			s0x[o0 += gds] = 0;
+		}
+	}
+	else
 	{
-		s0x[o0 += gds] = uniform_01(rng);
+		rd0 = uniform_01(rng);
+		s0x[o0  = gid] = rd0 * cr1[0] + (1 - rd0) * cr0[0];
+		rd0 = uniform_01(rng);
+		s0x[o0 += gds] = rd0 * cr1[1] + (1 - rd0) * cr0[1];
+		rd0 = uniform_01(rng);
+		s0x[o0 += gds] = rd0 * cr1[2] + (1 - rd0) * cr0[2];
+		rd0 = uniform_01(rng);
+		rd1 = uniform_01(rng);
+		rd2 = uniform_01(rng);
+		rd3 = uniform_01(rng);
+		rst = 1 / sqrt(rd0*rd0 + rd1*rd1 + rd2*rd2 + rd3*rd3);
+		s0x[o0 += gds] = rd0 * rst;
+		s0x[o0 += gds] = rd1 * rst;
+		s0x[o0 += gds] = rd2 * rst;
+		s0x[o0 += gds] = rd3 * rst;
+		for (i = 6; i < nv; ++i)
+		{
+			s0x[o0 += gds] = uniform_01(rng);
+		}
 	}
-	evaluate(s0e, s0g, s0a, s0q, s0c, s0d, s0f, s0t, s0x, nf, na, np, eub, lig, sfe, sfd, sfs, cr0, cr1, npr, gri, mps, gid, gds);
+	evl(s0e, s0g, s0a, s0q, s0c, s0d, s0f, s0t, s0x, nf, na, np, eub, lig, sfe, sfd, sfs, cr0, cr1, npr, gri, mps, gid, gds);
+	nev = 1;
+	hsf = 1.0f;
 
 	// Repeat for a number of generations.
 	for (g = 0; g < nbi; ++g)
@@ -389,20 +396,42 @@ void monte_carlo(float* const s0e, const int* const lig, const int nv, const int
 			o0 += gds;
 			s1x[o0] = s0x[o0];
 		}
-		evaluate(s1e, s1g, s1a, s1q, s1c, s1d, s1f, s1t, s1x, nf, na, np, eub, lig, sfe, sfd, sfs, cr0, cr1, npr, gri, mps, gid, gds);
+		evl(s1e, s1g, s1a, s1q, s1c, s1d, s1f, s1t, s1x, nf, na, np, eub, lig, sfe, sfd, sfs, cr0, cr1, npr, gri, mps, gid, gds);
+		++nev;
 
 		// Initialize the inverse Hessian matrix to identity matrix.
 		// An easier option that works fine in practice is to use a scalar multiple of the identity matrix,
 		// where the scaling factor is chosen to be in the range of the eigenvalues of the true Hessian.
 		// See N&R for a recipe to find this initializer.
-		bfh[o0 = gid] = 1.0f;
-		for (j = 1; j < nv; ++j)
+		// If hdm > 0, the inverse Hessian of the previous generation is carried over instead,
+		// damped towards the scaled identity matrix hsf * I, because the mutation only translates the ligand.
+		ini = g == 0 || hdm == 0.0f;
+		if (ini)
+		{
+			bfh[o0 = gid] = 1.0f;
+			for (j = 1; j < nv; ++j)
+			{
+				for (i = 0; i < j; ++i)
+				{
+					bfh[o0 += gds] = 0.0f;
+				}
+				bfh[o0 += gds] = 1.0f;
+			}
+		}
+		else
 		{
-			for (i = 0; i < j; ++i)
+			o0 = gid;
+			bfh[o0] = hdm * bfh[o0] + (1.0f - hdm) * hsf;
+			for (j = 1; j < nv; ++j)
 			{
-				bfh[o0 += gds] = 0.0f;
+				for (i = 0; i < j; ++i)
+				{
+					o0 += gds;
+					bfh[o0] = hdm * bfh[o0];
+				}
+				o0 += gds;
+				bfh[o0] = hdm * bfh[o0] + (1.0f - hdm) * hsf;
 			}
-			bfh[o0 += gds] = 1.0f;
 		}
 
 		// Use BFGS to optimize the mutated conformation s1x into local optimum s2x.
@@ -442,7 +471,15 @@ void monte_carlo(float* const s0e, const int* const lig, const int nv, const int
 			// Perform a line search to find an appropriate alpha.
 			// Try different alpha values for nls times.
 			// alpha starts with 1, and shrinks to 0.1 of itself iteration by iteration.
-			alp = 1.0f;
+			// If lsi or hsc is set, alpha is instead bracketed in [alo, ahi] as per N&W algorithms 3.5 and 3.6,
+			// where alo is the longest trial satisfying the Armijo rule but not the curvature condition, and ahi the shortest trial violating the Armijo rule.
+			// Should the trials run out with alo > 0, alo is retaken in an extra trial, which decreases e sufficiently but yields no curvature pair.
+			// While h is still the identity matrix, the first trial is scaled to a step of unit length, i.e. alpha = 1 / |g|, because a step of the gradient itself is often decades too long.
+			alp = (lsi || hsc) && ini ? fmin(1.0f, 1.0f / sqrt(-pg1)) : 1.0f;
+			alo = 0.0f;
+			elo = s1e[gid];
+			plo = pg1;
+			ahi = 0.0f;
 			for (j = 0; j < nls; ++j)
 			{
 				// Calculate x2 = x1 + a * p.
@@ -466,7 +503,7 @@ void monte_carlo(float* const s0e, const int* const lig, const int nv, const int
 				assert(fabs(s1xq0*s1xq0 + s1xq1*s1xq1 + s1xq2*s1xq2 + s1xq3*s1xq3 - 1.0f) < 2e-3f);
 				nrm = sqrt(pr0*pr0 + pr1*pr1 + pr2*pr2);
 				ang = 0.5f * alp * nrm;
-				sng = sin(ang) / nrm;
+				sng = nrm > 0.0f ? sin(ang) / nrm : 0.5f * alp; // The limit of sin(ang) / nrm as nrm approaches 0 is 0.5 * alp.
 				pq0 = cos(ang);
 				pq1 = sng * pr0;
 				pq2 = sng * pr1;
@@ -491,7 +528,59 @@ void monte_carlo(float* const s0e, const int* const lig, const int nv, const int
 				// Evaluate x2, subject to Wolfe conditions http://en.wikipedia.org/wiki/Wolfe_conditions
 				// 1) Armijo rule ensures that the step length alpha decreases f sufficiently.
 				// 2) The curvature condition ensures that the slope has been reduced sufficiently.
-				if (evaluate(s2e, s2g, s2a, s2q, s2c, s2d, s2f, s2t, s2x, nf, na, np, s1e[gid] + alp * pga, lig, sfe, sfd, sfs, cr0, cr1, npr, gri, mps, gid, gds))
+				++nev;
+				if (lsi || hsc)
+				{
+					if (evl(s2e, s2g, s2a, s2q, s2c, s2d, s2f, s2t, s2x, nf, na, np, s1e[gid] + alp * pga, lig, sfe, sfd, sfs, cr0, cr1, npr, gri, mps, gid, gds) && (alp == alo || s2e[gid] < elo))
+					{
+						if (alp == alo) break;
+						o0 = gid;
+						pg2 = bfp[o0] * s2g[o0];
+						for (i = 1; i < nv; ++i)
+						{
+							o0 += gds;
+							pg2 += bfp[o0] * s2g[o0];
+						}
+						if (pg2 >= pgc) break;
+
+						// The step is too short to reduce the slope sufficiently, e.g. after hsc has scaled the inverse Hessian by the stiffest variables.
+						alo = alp;
+						elo = s2e[gid];
+						plo = pg2;
+					}
+					else
+					{
+						ahi = alp;
+						ehi = s2e[gid];
+					}
+
+					// Extrapolate until a trial violates the Armijo rule, and zoom into [alo, ahi] afterwards.
+					// If lsi is set, zoom to the minimizer of the quadratic interpolating elo, plo and ehi, safeguarded within [0.1, 0.5] of the bracket,
+					// or otherwise shrink alpha to 0.1 of itself as the default line search does until a lower end is found, and bisect the bracket then.
+					if (ahi == 0.0f)
+					{
+						alp *= 10.0f;
+					}
+					else
+					{
+						dal = ahi - alo;
+						if (lsi)
+						{
+							alp = alo + fmax(0.1f * dal, fmin(0.5f * dal, -0.5f * plo * dal * dal / (ehi - elo - plo * dal)));
+						}
+						else
+						{
+							alp = alo == 0.0f ? 0.1f * ahi : alo + 0.5f * dal;
+						}
+					}
+					if (j == nls - 1 && alo > 0.0f && alp != alo)
+					{
+						alp = alo;
+						--j;
+					}
+					continue;
+				}
+				if (evl(s2e, s2g, s2a, s2q, s2c, s2d, s2f, s2t, s2x, nf, na, np, s1e[gid] + alp * pga, lig, sfe, sfd, sfs, cr0, cr1, npr, gri, mps, gid, gds))
 				{
 					o0 = gid;
 					pg2 = bfp[o0] * s2g[o0];
@@ -509,6 +598,20 @@ void monte_carlo(float* const s0e, const int* const lig, const int nv, const int
 			// If no appropriate alpha can be found, exit the BFGS loop.
 			if (j == nls) break;
 
+			// Move to a retaken alo without updating h, which the lack of a curvature pair would no longer keep positive definite.
+			// The scaling of hsc thus still awaits the first curvature pair.
+			if (alp == alo)
+			{
+				o0 = gid;
+				s1e[o0] = s2e[o0];
+				for (i = -1 - 2 * nv; i < 0; ++i)
+				{
+					o0 += gds;
+					s1e[o0] = s2e[o0];
+				}
+				continue;
+			}
+
 			// Calculate y = g2 - g1.
 			o0 = gid;
 			bfy[o0] = s2g[o0] - s1g[o0];
@@ -518,6 +621,39 @@ void monte_carlo(float* const s0e, const int* const lig, const int nv, const int
 				bfy[o0] = s2g[o0] - s1g[o0];
 			}
 
+			// Calculate yps = y * p.
+			o0 = gid;
+			yps = bfy[o0] * bfp[o0];
+			for (i = 1; i < nv; ++i)
+			{
+				o0 += gds;
+				yps += bfy[o0] * bfp[o0];
+			}
+
+			// Scale the initial identity matrix by y * s / (y * y), where s = alpha * p, so that its magnitude approximates that of the true inverse Hessian.
+			// See N&W equation 6.20.
+			if (hsc && ini)
+			{
+				o0 = gid;
+				yty = bfy[o0] * bfy[o0];
+				for (i = 1; i < nv; ++i)
+				{
+					o0 += gds;
+					yty += bfy[o0] * bfy[o0];
+				}
+				if (yps > 0.0f && yty > 0.0f)
+				{
+					hsf = alp * yps / yty;
+					bfh[o0 = gid] = hsf;
+					for (j = 1; j < nv; ++j)
+					{
+						o0 += (j + 1) * gds;
+						bfh[o0] = hsf;
+					}
+				}
+			}
+			ini = 0;
+
 			// Calculate m = -h * y.
 			sum = bfh[o1 = gid] * bfy[o0 = gid];
 			for (i = 1; i < nv; ++i)
@@ -544,15 +680,6 @@ void monte_carlo(float* const s0e, const int* const lig, const int nv, const int
 				yhy -= bfy[o0] * bfm[o0];
 			}
 
-			// Calculate yps = y * p.
-			o0 = gid;
-			yps = bfy[o0] * bfp[o0];
-			for (i = 1; i < nv; ++i)
-			{
-				o0 += gds;
-				yps += bfy[o0] * bfp[o0];
-			}
-
 			// Update Hessian matrix h.
 			ryp = 1.0f / yps;
 			pco = ryp * (ryp * yhy + alp);
@@ -596,4 +723,5 @@ void monte_carlo(float* const s0e, const int* const lig, const int nv, const int
 			}
 		}
 	}
+	return nev;
 }
@@ -3,8 +3,17 @@
 #define IDOCK_KERNEL_HPP
 
 #include <array>
+#include <vector>
 using namespace std;
 
-void monte_carlo(float* const s0e, const int* const lig, const int nv, const int nf, const int na, const int np, const int seed, const int nbi, const float* const sfe, const float* const sfd, const int sfs, const array<float, 3> cr0, const array<float, 3> cr1, const array<int, 3> npr, const float gri, const vector<vector<float>>& mps, const int gid, const int gds);
+//! Evaluates the free energy and its gradient of a conformation, returning false without the gradient if the free energy, which is stored regardless, is no better than eub.
+typedef bool (*evaluator)(float* e, float* g, float* a, float* q, float* c, float* d, float* f, float* t, const float* x, const int nf, const int na, const int np, const float eub, const int* shared, const float* sfe, const float* sfd, const int sfs, const array<float, 3> cr0, const array<float, 3> cr1, const array<int, 3> npr, const float gri, const vector<vector<float>>& mps, const int gid, const int gds);
+
+//! Evaluates a conformation of any ligand by interpreting its encoded frame tree.
+bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float* f, float* t, const float* x, const int nf, const int na, const int np, const float eub, const int* shared, const float* sfe, const float* sfd, const int sfs, const array<float, 3> cr0, const array<float, 3> cr1, const array<int, 3> npr, const float gri, const vector<vector<float>>& mps, const int gid, const int gds);
+
+//! Performs Monte Carlo global search with BFGS local optimization, evaluating conformations by evl, and returns the number of evaluations.
+//! If org is given, the search starts from its ROOT frame position and orientation with the input torsions instead of a random conformation.
+int monte_carlo(float* const s0e, const int* const lig, const evaluator evl, const int nv, const int nf, const int na, const int np, const int seed, const float* const org, const int nbi, const float hdm, const bool hsc, const bool lsi, const float* const sfe, const float* const sfd, const int sfs, const array<float, 3> cr0, const array<float, 3> cr1, const array<int, 3> npr, const float gri, const vector<vector<float>>& mps, const int gid, const int gds);
 
 #endif
@@ -1,5 +1,7 @@
 #include <iomanip>
 #include <numeric>
+#include <limits>
+#include <boost/functional/hash.hpp>
 #include "array.hpp"
 #include "ligand.hpp"
 
@@ -8,7 +10,7 @@ void frame::output(boost::filesystem::ofstream& ofs) const
 	ofs << "BRANCH"    << setw(4) << rotorXsrn << setw(4) << rotorYsrn << '\n';
 }
 
-ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
+ligand::ligand(const path& p, const bool reroot) : filename(p.filename()), xs{}
 {
 	// Initialize necessary variables for constructing a ligand.
 	frames.reserve(30); // A ligand typically consists of <= 30 frames.
@@ -136,17 +138,6 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 			// This emptiness is likely to be caused by invalid input structure, especially when all the atoms are located in the same plane.
 			if (f->rotorYidx == atoms.size()) throw domain_error("Error parsing " + p.filename().string() + ": an empty BRANCH has been detected, indicating the input ligand structure is probably invalid.");
 
-			// If the current frame consists of rotor Y and a few hydrogens only, e.g. -OH, -NH2 or -CH3,
-			// the torsion of this frame will have no effect on scoring and is thus redundant.
-			if (current + 1 == frames.size() && f->rotorYidx + 1 == atoms.size())
-			{
-				f->active = false;
-			}
-			else
-			{
-				++nv;
-			}
-
 			// Set up bonds between rotorX and rotorY.
 			bonds[f->rotorYidx].push_back(f->rotorXidx);
 			bonds[f->rotorXidx].push_back(f->rotorYidx);
@@ -157,11 +148,6 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 			if (rotorY.is_hetero() && !rotorX.is_hetero()) rotorX.dehydrophobicize();
 			if (rotorX.is_hetero() && !rotorY.is_hetero()) rotorY.dehydrophobicize();
 
-			// Calculate yy and xy.
-			const frame& p = frames[f->parent];
-			f->yy = rotorY.coord - atoms[p.rotorYidx].coord;
-			f->xy = normalize(rotorY.coord - rotorX.coord);
-
 			// Now the parent of the following frame is the parent of current frame.
 			current = f->parent;
 
@@ -199,8 +185,223 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 	assert(current == 0); // current should remain its original value if "BRANCH" and "ENDBRANCH" properly match each other.
 	assert(f == &frames.front()); // The frame pointer should remain its original value if "BRANCH" and "ENDBRANCH" properly match each other.
 	frames.back().childYidx = na = atoms.size();
+
+	// Save the parsed frames, from which conformations are written in the original PDBQT layout.
+	// The frames used for docking are normalized below, and may have a different root, numbering and atom order.
+	input_frames = move(frames);
+	const size_t ni = input_frames.size();
+	vector<size_t> owners(na); // Indexes to the input frames that the heavy atoms belong to.
+	for (size_t k = 0; k < ni; ++k)
+	{
+		const frame& f = input_frames[k];
+		fill(owners.begin() + f.rotorYidx, owners.begin() + f.childYidx, k);
+	}
+
+	// Orient the input frame tree from a given root frame by breadth-first traversal.
+	// A rotatable bond between two frames is traversed from its atom in the parent frame, i.e. rotor X, to its atom in the child frame, i.e. rotor Y,
+	// which becomes the origin of the child frame. The origin of the root frame is its first atom, or its rotor Y if the root is a BRANCH frame.
+	vector<size_t> sequence(ni); // Input frames in breadth-first order.
+	vector<size_t> parents(ni); // Indexes to the parents of the input frames in the oriented tree.
+	vector<size_t> rotorXs(ni); // Indexes to the rotor X atoms of the input frames in the oriented tree.
+	vector<size_t> rotorYs(ni); // Indexes to the rotor Y atoms, i.e. origins, of the input frames in the oriented tree.
+	const auto orient = [&](const size_t root)
+	{
+		vector<bool> visited(ni);
+		visited[root] = true;
+		sequence.front() = parents[root] = root;
+		rotorXs[root] = rotorYs[root] = input_frames[root].rotorYidx;
+		for (size_t h = 0, t = 1; h < t; ++h)
+		{
+			const size_t k = sequence[h];
+			const frame& f = input_frames[k];
+			if (k && !visited[f.parent]) // Reverse the bond to the input parent.
+			{
+				visited[f.parent] = true;
+				sequence[t++] = f.parent;
+				parents[f.parent] = k;
+				rotorXs[f.parent] = f.rotorYidx;
+				rotorYs[f.parent] = f.rotorXidx;
+			}
+			for (const size_t b : f.branches)
+			{
+				if (visited[b]) continue;
+				visited[b] = true;
+				sequence[t++] = b;
+				parents[b] = k;
+				rotorXs[b] = input_frames[b].rotorXidx;
+				rotorYs[b] = input_frames[b].rotorYidx;
+			}
+		}
+	};
+
+	// Re-root the tree at the frame that minimizes the maximum lever arm if requested.
+	// The lever arm of an atom is bounded by the length of the path from the root origin through the origins of the frames in between to the atom,
+	// regardless of the conformation. Shorter lever arms make the rotation of the root frame better conditioned in BFGS.
+	orient(0);
+	if (reroot)
+	{
+		size_t root = 0;
+		float best = numeric_limits<float>::max();
+		vector<float> reaches(ni); // Path lengths from the root origin to the frame origins.
+		for (size_t r = 0; r < ni; ++r)
+		{
+			// Skip frames of less than 3 heavy atoms, whose orientation would be partially redundant with the torsions of their children.
+			const frame& f = input_frames[r];
+			if (f.rotorYidx + 3 > f.childYidx) continue;
+			orient(r);
+			float lever = 0;
+			for (const size_t k : sequence)
+			{
+				reaches[k] = k == r ? 0 : reaches[parents[k]] + norm(atoms[rotorYs[k]].coord - atoms[rotorYs[parents[k]]].coord);
+				for (size_t i = 0; i < na; ++i)
+				{
+					if (owners[i] != k) continue;
+					lever = max(lever, reaches[k] + norm(atoms[i].coord - atoms[rotorYs[k]].coord));
+				}
+			}
+			if (lever < best)
+			{
+				best = lever;
+				root = r;
+			}
+		}
+		orient(root);
+	}
+
+	// Find the children of the input frames in the oriented tree.
+	vector<vector<size_t>> children(ni);
+	for (const size_t k : sequence)
+	{
+		if (k == sequence.front()) continue;
+		children[parents[k]].push_back(k);
+	}
+
+	// Create the normalized frames in breadth-first order, so that the torsions of BRANCH frames are ordered by frame index.
+	// If a terminal frame consists of rotor Y and a few hydrogens only, e.g. -OH, -NH2 or -CH3,
+	// the torsion of this frame will have no effect on scoring and is thus redundant. Such a frame is folded into its parent.
+	vector<atom> input_atoms = move(atoms);
+	input_order.resize(na);
+	atoms.reserve(na);
+	frames.reserve(ni);
+	vector<size_t> indexes(ni); // Indexes to the normalized frames of the unfolded input frames.
+	for (const size_t k : sequence)
+	{
+		const frame& f = input_frames[k];
+		if (k != sequence.front() && children[k].empty() && f.rotorYidx + 1 == f.childYidx) continue;
+		indexes[k] = frames.size();
+		if (frames.empty())
+		{
+			frames.emplace_back(0, 0, 0, 0, 0);
+		}
+		else
+		{
+			frame& p = frames[indexes[parents[k]]];
+			p.branches.push_back(frames.size());
+			frames.emplace_back(indexes[parents[k]], input_atoms[rotorXs[k]].serial, input_atoms[rotorYs[k]].serial, input_order[rotorXs[k]], atoms.size());
+		}
+
+		// Lay out the atoms of the frame contiguously, starting with its origin, followed by the atoms of its folded children.
+		const auto lay = [&](const size_t i)
+		{
+			input_order[i] = atoms.size();
+			atoms.push_back(move(input_atoms[i]));
+		};
+		lay(rotorYs[k]);
+		for (size_t i = f.rotorYidx; i < f.childYidx; ++i)
+		{
+			if (i != rotorYs[k]) lay(i);
+		}
+		for (const size_t c : children[k])
+		{
+			const frame& b = input_frames[c];
+			if (children[c].empty() && b.rotorYidx + 1 == b.childYidx) lay(b.rotorYidx);
+		}
+		frames.back().childYidx = atoms.size();
+	}
+	assert(atoms.size() == na);
 	nf = frames.size();
-	assert(nf >= 1 + nv - 6);
+	nv = 6 + nf - 1;
+
+	// Map the covalent bonds to the normalized atom order.
+	{
+		vector<vector<size_t>> input_bonds = move(bonds);
+		bonds.resize(na);
+		for (size_t i = 0; i < na; ++i)
+		{
+			vector<size_t>& b = bonds[input_order[i]];
+			b.reserve(input_bonds[i].size());
+			for (const size_t j : input_bonds[i])
+			{
+				b.push_back(input_order[j]);
+			}
+		}
+	}
+
+	// Fingerprint the scaffold by pruning terminal heavy atoms repeatedly and hashing the remaining graph with 3 iterations of neighborhood refinement.
+	// An acyclic ligand, which would be pruned entirely, is fingerprinted as a whole.
+	{
+		vector<size_t> degrees(na);
+		vector<size_t> terminals;
+		for (size_t i = 0; i < na; ++i)
+		{
+			degrees[i] = bonds[i].size();
+			if (degrees[i] <= 1) terminals.push_back(i);
+		}
+		vector<bool> pruned(na);
+		size_t num_pruned = 0;
+		while (!terminals.empty())
+		{
+			const size_t i = terminals.back();
+			terminals.pop_back();
+			pruned[i] = true;
+			++num_pruned;
+			for (const size_t j : bonds[i])
+			{
+				if (!pruned[j] && --degrees[j] == 1) terminals.push_back(j);
+			}
+		}
+		if (num_pruned == na) pruned.assign(na, false);
+		vector<size_t> labels(na), refined(na), neighbors;
+		for (size_t i = 0; i < na; ++i)
+		{
+			labels[i] = atoms[i].ad;
+		}
+		for (size_t r = 0; r < 3; ++r)
+		{
+			for (size_t i = 0; i < na; ++i)
+			{
+				if (pruned[i]) continue;
+				neighbors.clear();
+				for (const size_t j : bonds[i])
+				{
+					if (!pruned[j]) neighbors.push_back(labels[j]);
+				}
+				sort(neighbors.begin(), neighbors.end());
+				refined[i] = labels[i];
+				boost::hash_range(refined[i], neighbors.cbegin(), neighbors.cend());
+			}
+			swap(labels, refined);
+		}
+		for (size_t i = 0; i < na; ++i)
+		{
+			if (!pruned[i]) scaffold.emplace_back(labels[i], i);
+		}
+		sort(scaffold.begin(), scaffold.end());
+		fingerprint = 0;
+		for (const pair<size_t, size_t>& s : scaffold)
+		{
+			boost::hash_combine(fingerprint, s.first);
+		}
+	}
+
+	// Calculate yy and xy.
+	for (size_t k = 1; k < nf; ++k)
+	{
+		frame& f = frames[k];
+		const array<float, 3>& rotorY = atoms[f.rotorYidx].coord;
+		f.yy = rotorY - atoms[frames[f.parent].rotorYidx].coord;
+		f.xy = normalize(rotorY - atoms[f.rotorXidx].coord);
+	}
 
 	// Detect the presence of XScore atom types.
 	for (const auto& a : atoms)
@@ -208,20 +409,72 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 		xs[a.xs] = true;
 	}
 
-	// Update atoms[].coord relative to frame origin.
-	for (const frame& f : frames)
+	// Return a lower bound of the distance between atom i of frame k1 and atom j of frame k2 over all possible torsions.
+	// Each rotatable bond on the path between the two frames is an axis fixed relative to both frames it joins.
+	// Given the ranges of distances from atom i to the two atoms of an axis, the axial and radial coordinates of atom i about the axis are bounded,
+	// from which the ranges of distances to the atoms of the next axis, or to atom j, are obtained by rotating them about the axis.
+	vector<array<size_t, 2>> axes; // Atoms on the rotatable bonds from frame k1 to frame k2.
+	vector<array<size_t, 2>> descents; // Atoms on the rotatable bonds from frame k2 up to the lowest common ancestor.
+	axes.reserve(nf);
+	descents.reserve(nf);
+	const auto min_distance = [&](const size_t i, size_t k1, const size_t j, size_t k2)
 	{
-		const array<float, 3> origin = atoms[f.rotorYidx].coord;
-		for (size_t i = f.rotorYidx; i < f.childYidx; ++i)
+		// Frames are numbered breadth-first, so the frame of larger index is never an ancestor of the other.
+		axes.clear();
+		descents.clear();
+		while (k1 != k2)
 		{
-			atom& a = atoms[i];
-			a.coord -= origin;
-			for (atom& h : a.hydrogens)
+			if (k1 > k2)
 			{
-				h.coord -= origin;
+				axes.push_back({{ frames[k1].rotorYidx, frames[k1].rotorXidx }});
+				k1 = frames[k1].parent;
+			}
+			else
+			{
+				descents.push_back({{ frames[k2].rotorXidx, frames[k2].rotorYidx }});
+				k2 = frames[k2].parent;
 			}
 		}
-	}
+		axes.insert(axes.end(), descents.rbegin(), descents.rend());
+		const size_t m = axes.size();
+		assert(m);
+
+		// Initialize the ranges of distances from atom i to the atoms of the first axis, which are fixed relative to atom i.
+		array<float, 2> lo, hi;
+		for (size_t t = 0; t < 2; ++t)
+		{
+			lo[t] = hi[t] = sqrt(distance_sqr(atoms[i].coord, atoms[axes[0][t]].coord));
+		}
+		for (size_t k = 0; k < m; ++k)
+		{
+			// Bound the axial coordinate h and the radial coordinate r of atom i about the current axis from u to v.
+			const array<float, 3>& u = atoms[axes[k][0]].coord;
+			const array<float, 3>& v = atoms[axes[k][1]].coord;
+			const array<float, 3> e = normalize(v - u);
+			const float l = sqrt(distance_sqr(u, v));
+			const float hlo = max(max(-hi[0], l - hi[1]), (lo[0] * lo[0] - hi[1] * hi[1] + l * l) / (2 * l));
+			const float hhi = min(min( hi[0], l + hi[1]), (hi[0] * hi[0] - lo[1] * lo[1] + l * l) / (2 * l));
+			const float hu = hlo > 0 ? hlo : hhi < 0 ? -hhi : 0; // Minimum of |h|.
+			const float hv = hlo > l ? hlo - l : hhi < l ? l - hhi : 0; // Minimum of |h - l|.
+			const float rlo = sqrt(max(0.0f, max(lo[0] * lo[0] - max(hlo * hlo, hhi * hhi), lo[1] * lo[1] - max((hlo - l) * (hlo - l), (hhi - l) * (hhi - l)))));
+			const float rhi = sqrt(max(0.0f, min(hi[0] * hi[0] - hu * hu, hi[1] * hi[1] - hv * hv)));
+
+			// Rotate the targets about the current axis, and bound their distances from atom i.
+			const array<size_t, 2> targets = k + 1 == m ? array<size_t, 2>{{ j, j }} : axes[k + 1];
+			for (size_t t = 0; t < 2; ++t)
+			{
+				const array<float, 3> w = atoms[targets[t]].coord - u;
+				const float h = w[0] * e[0] + w[1] * e[1] + w[2] * e[2];
+				const float r = sqrt(max(0.0f, norm_sqr(w) - h * h));
+				const float dh = h < hlo ? hlo - h : h > hhi ? h - hhi : 0;
+				const float dr = r < rlo ? rlo - r : r > rhi ? r - rhi : 0;
+				const float mh = max(fabs(h - hlo), fabs(h - hhi));
+				lo[t] = sqrt(dh * dh + dr * dr);
+				hi[t] = sqrt(mh * mh + (rhi + r) * (rhi + r));
+			}
+		}
+		return lo[0];
+	};
 
 	// Find intra-ligand interacting pairs that are not 1-4.
 	interacting_pairs.reserve(na * na);
@@ -267,6 +520,8 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 					if (k1 > 0 && f1.parent == f2.parent && i == f1.rotorYidx && j == f2.rotorYidx) continue;
 					if (f2.parent > 0 && k1 == f3.parent && i == f3.rotorXidx && j == f2.rotorYidx) continue;
 					if (find(neighbors.cbegin(), neighbors.cend(), j) != neighbors.cend()) continue;
+					const float d = min_distance(i, k1, j, k2);
+					if (d * d >= scoring_function::cutoff_sqr) continue; // The pair can never come within the cutoff.
 					interacting_pairs.emplace_back(i, j, scoring_function::nr * mp(t1, atoms[j].xs));
 				}
 			}
@@ -276,6 +531,21 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 		}
 	}
 	np = interacting_pairs.size();
+
+	// Update atoms[].coord relative to frame origin.
+	for (const frame& f : frames)
+	{
+		const array<float, 3> origin = atoms[f.rotorYidx].coord;
+		for (size_t i = f.rotorYidx; i < f.childYidx; ++i)
+		{
+			atom& a = atoms[i];
+			a.coord -= origin;
+			for (atom& h : a.hydrogens)
+			{
+				h.coord -= origin;
+			}
+		}
+	}
 }
 
 size_t ligand::get_lig_elems() const
@@ -294,10 +564,33 @@ size_t ligand::get_cnf_elems() const
 	return 1 + nv + 1;
 }
 
+size_t ligand::get_cnf_key(const size_t receptor_key) const
+{
+	// Conformations are decoded relative to the frame tree, its root origin and the atom order, all of which depend on reroot as well as on the input file.
+	size_t h = receptor_key;
+	for (size_t k = 0; k < nf; ++k)
+	{
+		const frame& f = frames[k];
+		boost::hash_combine(h, f.rotorYidx);
+		boost::hash_combine(h, f.childYidx);
+		if (!k) continue; // The parent, yy and xy of ROOT frame are not used.
+		boost::hash_combine(h, f.parent);
+		boost::hash_range(h, f.yy.cbegin(), f.yy.cend());
+		boost::hash_range(h, f.xy.cbegin(), f.xy.cend());
+	}
+	for (const atom& a : atoms)
+	{
+		boost::hash_combine(h, a.serial);
+		boost::hash_combine(h, a.ad);
+		boost::hash_range(h, a.coord.cbegin(), a.coord.cend());
+	}
+	return h;
+}
+
 void ligand::encode(int* const p) const
 {
 	int* c = p;
-	for (const frame& f : frames) *c++ = f.active;
+	for (size_t k = 0; k < nf; ++k) *c++ = 1; // Every normalized frame is active. The flags are kept for the layout shared with the GPU kernels.
 	for (const frame& f : frames) *c++ = f.rotorYidx;
 	for (const frame& f : frames) *c++ = f.childYidx;
 	for (const frame& f : frames) *c++ = f.branches.size();
@@ -349,6 +642,14 @@ void ligand::write(const float* const ex, const path& output_folder_path, const
 		return ex[v0] < ex[v1];
 	});
 
+	// Find the normalized frames that the heavy atoms belong to.
+	vector<size_t> owners(na);
+	for (size_t k = 0; k < nf; ++k)
+	{
+		const frame& f = frames[k];
+		fill(owners.begin() + f.rotorYidx, owners.begin() + f.childYidx, k);
+	}
+
 	// Cluster solutions with RMSD of 2.0 and save them on the fly.
 	const float square_deviation_threshold = 4.0f * na;
 	vector<solution> solutions;
@@ -374,7 +675,6 @@ void ligand::write(const float* const ex, const path& output_folder_path, const
 		for (size_t k = 0; k < nf; ++k)
 		{
 			const frame& f = frames[k];
-			if (!f.active) continue;
 			const array<float, 9> m = qtn4_to_mat3(s.q[k]);
 			for (size_t i = f.rotorYidx + 1; i < f.childYidx; ++i)
 			{
@@ -384,7 +684,6 @@ void ligand::write(const float* const ex, const path& output_folder_path, const
 			{
 				const frame& b = frames[i];
 				s.c[b.rotorYidx] = s.c[f.rotorYidx] + m * b.yy;
-				if (!b.active) continue;
 				const array<float, 3> a = m * b.xy;
 				assert(normalized(a));
 				s.q[i] = vec4_to_qtn4(a, ex[o += num_tasks]) * s.q[k];
@@ -429,33 +728,45 @@ void ligand::write(const float* const ex, const path& output_folder_path, const
 				}
 			}
 		}
-		x.back() = 1 / (1 + 0.05846f * (nv - 6 + 0.5f * (nf - 1 - (nv - 6))));
+		x.back() = 1 / (1 + 0.05846f * (nv - 6 + 0.5f * (input_frames.size() - 1 - (nv - 6))));
 		affinities.push_back(ex[r]);
 //		affinities.push_back(f(x));
 
-		// Dump the ROOT frame.
-		ofs << "ROOT\n";
+		// Calculate the orientation matrices of the normalized frames, which transform the hydrogens.
+		vector<array<float, 9>> m(nf);
+		for (size_t k = 0; k < nf; ++k)
+		{
+			m[k] = qtn4_to_mat3(s.q[k]);
+		}
+
+		// Dump the atoms of an input frame in the input order.
+		const auto dump = [&](const frame& f)
 		{
-			const frame& f = frames.front();
-			const array<float, 9> m = qtn4_to_mat3(s.q[0]);
 			for (size_t i = f.rotorYidx; i < f.childYidx; ++i)
 			{
-				const atom& a = atoms[i];
-				a.output(ofs, s.c[i]);
+				const size_t j = input_order[i];
+				const size_t k = owners[j];
+				const atom& a = atoms[j];
+				a.output(ofs, s.c[j]);
 				for (const atom& h : a.hydrogens)
 				{
-					h.output(ofs, s.c[f.rotorYidx] + m * h.coord);
+					h.output(ofs, s.c[frames[k].rotorYidx] + m[k] * h.coord);
 				}
 			}
-		}
+		};
+
+		// Dump the ROOT frame.
+		ofs << "ROOT\n";
+		dump(input_frames.front());
 		ofs << "ENDROOT\n";
 
 		// Dump the BRANCH frames.
-		vector<bool> dumped(nf); // dump_branches[0] is dummy. The ROOT frame has been dumped.
+		const size_t ni = input_frames.size();
+		vector<bool> dumped(ni); // dump_branches[0] is dummy. The ROOT frame has been dumped.
 		vector<size_t> stack; // Stack to track the depth-first traversal sequence of frames in order to avoid recursion.
-		stack.reserve(nf - 1); // The ROOT frame is excluded.
+		stack.reserve(ni - 1); // The ROOT frame is excluded.
 		{
-			const frame& f = frames.front();
+			const frame& f = input_frames.front();
 			for (auto i = f.branches.rbegin(); i < f.branches.rend(); ++i)
 			{
 				stack.push_back(*i);
@@ -464,7 +775,7 @@ void ligand::write(const float* const ex, const path& output_folder_path, const
 		while (!stack.empty())
 		{
 			const size_t fn = stack.back();
-			const frame& f = frames[fn];
+			const frame& f = input_frames[fn];
 			if (dumped[fn]) // This BRANCH frame has been dumped.
 			{
 				ofs << "END";
@@ -474,16 +785,7 @@ void ligand::write(const float* const ex, const path& output_folder_path, const
 			else // This BRANCH frame has not been dumped.
 			{
 				f.output(ofs);
-				const array<float, 9> m = qtn4_to_mat3(s.q[f.active ? fn : f.parent]);
-				for (size_t i = f.rotorYidx; i < f.childYidx; ++i)
-				{
-					const atom& a = atoms[i];
-					a.output(ofs, s.c[i]);
-					for (const atom& h : a.hydrogens)
-					{
-						h.output(ofs, s.c[f.rotorYidx] + m * h.coord);
-					}
-				}
+				dump(f);
 				dumped[fn] = true;
 				for (auto i = f.branches.rbegin(); i < f.branches.rend(); ++i)
 				{
@@ -491,10 +793,177 @@ void ligand::write(const float* const ex, const path& output_folder_path, const
 				}
 			}
 		}
-		ofs << "TORSDOF " << nf - 1 << '\n';
+		ofs << "TORSDOF " << ni - 1 << '\n';
 
 		// Check if the number of conformations to write has been reached the upper bound.
 		solutions.push_back(move(s));
 		if (solutions.size() == solutions.capacity()) break;
 	}
+	if (!solutions.empty()) pose = move(solutions.front().c);
+}
+
+size_t ligand::load(vector<float>& ex, const path& output_folder_path, const size_t receptor_key) const
+{
+	// The file starts with the compatibility key, the number of elements of a conformation and the number of tasks, followed by the conformations strided by the number of tasks.
+	boost::filesystem::ifstream ifs(path(output_folder_path / filename).replace_extension(".cnf"), ios::binary);
+	array<size_t, 3> header;
+	if (!ifs.read(reinterpret_cast<char*>(header.data()), sizeof(header)) || header[0] != get_cnf_key(receptor_key) || header[1] != get_cnf_elems()) return 0;
+	ex.resize(header[1] * header[2]);
+	if (!ifs.read(reinterpret_cast<char*>(ex.data()), sizeof(float) * ex.size())) return 0;
+	return header[2];
+}
+
+void ligand::save(const float* const ex, const path& output_folder_path, const size_t num_tasks, const size_t receptor_key) const
+{
+	boost::filesystem::ofstream ofs(path(output_folder_path / filename).replace_extension(".cnf"), ios::binary);
+	const array<size_t, 3> header = {{ get_cnf_key(receptor_key), get_cnf_elems(), num_tasks }};
+	ofs.write(reinterpret_cast<const char*>(header.data()), sizeof(header));
+	ofs.write(reinterpret_cast<const char*>(ex), sizeof(float) * header[1] * num_tasks);
+}
+
+vector<array<float, 3>> ligand::recover() const
+{
+	vector<array<float, 3>> c(na);
+	for (size_t k = 0; k < nf; ++k)
+	{
+		const frame& f = frames[k];
+		const array<float, 3> o = k ? c[frames[f.parent].rotorYidx] + f.yy : array<float, 3>{};
+		for (size_t i = f.rotorYidx; i < f.childYidx; ++i)
+		{
+			c[i] = o + atoms[i].coord;
+		}
+	}
+	return c;
+}
+
+array<float, tree::nv> ligand::describe() const
+{
+	// Recover the input conformation.
+	const vector<array<float, 3>> c = recover();
+
+	// Count the pairs of RF-Score atom types within 12A, regarding the C, N, O and S atoms of the ligand itself as receptor atoms.
+	array<float, tree::nv> x{};
+	for (size_t i = 0; i < na; ++i)
+	{
+		const atom& la = atoms[i];
+		if (la.rf_unsupported()) continue;
+		for (size_t j = 0; j < na; ++j)
+		{
+			const atom& ra = atoms[j];
+			if (j == i || ra.rf_unsupported() || ra.rf > 3) continue;
+			if (distance_sqr(c[i], c[j]) < 144) ++x[(la.rf << 2) + ra.rf];
+		}
+	}
+
+	// Replace the five Vina terms with the numbers of heavy atoms, hetero atoms, hydrogens, interacting pairs and active torsions, and keep the flexibility term.
+	x[36] = static_cast<float>(na);
+	for (const atom& a : atoms)
+	{
+		x[37] += a.is_hetero();
+		x[38] += a.hydrogens.size();
+	}
+	x[39] = static_cast<float>(np);
+	x[40] = static_cast<float>(nv - 6);
+	x.back() = 1 / (1 + 0.05846f * (nv - 6 + 0.5f * (input_frames.size() - 1 - (nv - 6))));
+	return x;
+}
+
+vector<array<float, 3>> ligand::centroids(const vector<array<float, 3>>& c) const
+{
+	vector<array<float, 3>> centroids;
+	for (size_t i = 0, j; i < scaffold.size(); i = j)
+	{
+		array<float, 3> s{};
+		for (j = i; j < scaffold.size() && scaffold[j].first == scaffold[i].first; ++j)
+		{
+			s += c[scaffold[j].second];
+		}
+		centroids.push_back((1.0f / (j - i)) * s);
+	}
+	return centroids;
+}
+
+bool ligand::fit(array<float, 7>& org, const vector<array<float, 3>>& centroids) const
+{
+	// Pair each scaffold atom of the input conformation with the given centroid of its label, which is invariant to the correspondence among atoms of equal labels.
+	const size_t n = scaffold.size();
+	vector<size_t> labels(n);
+	for (size_t i = 1; i < n; ++i)
+	{
+		labels[i] = labels[i - 1] + (scaffold[i].first != scaffold[i - 1].first);
+	}
+	if (!n || labels.back() + 1 != centroids.size()) return false;
+	const vector<array<float, 3>> c = recover();
+	array<float, 3> ca{}, cb{};
+	for (size_t i = 0; i < n; ++i)
+	{
+		ca += c[scaffold[i].second];
+		cb += centroids[labels[i]];
+	}
+	ca = (1.0f / n) * ca;
+	cb = (1.0f / n) * cb;
+
+	// Accumulate the cross covariance of the centered pairs.
+	array<double, 9> s{};
+	for (size_t i = 0; i < n; ++i)
+	{
+		const array<float, 3> a = c[scaffold[i].second] - ca;
+		const array<float, 3> b = centroids[labels[i]] - cb;
+		for (size_t j = 0; j < 9; ++j)
+		{
+			s[j] += a[j / 3] * b[j % 3];
+		}
+	}
+
+	// The optimal rotation is the eigenvector of the largest eigenvalue of Horn's symmetric matrix, which repeated squaring of the matrix shifted to be positive semidefinite isolates.
+	double shift = 0;
+	for (const double v : s) shift += fabs(v);
+	array<double, 16> m =
+	{{
+		s[0] + s[4] + s[8] + shift, s[5] - s[7], s[6] - s[2], s[1] - s[3],
+		s[5] - s[7], s[0] - s[4] - s[8] + shift, s[1] + s[3], s[6] + s[2],
+		s[6] - s[2], s[1] + s[3], s[4] - s[0] - s[8] + shift, s[5] + s[7],
+		s[1] - s[3], s[6] + s[2], s[5] + s[7], s[8] - s[0] - s[4] + shift,
+	}};
+	for (size_t r = 0; r < 32; ++r)
+	{
+		array<double, 16> p{};
+		double pmax = 0;
+		for (size_t j = 0; j < 16; ++j)
+		{
+			for (size_t k = 0; k < 4; ++k)
+			{
+				p[j] += m[(j & ~3) + k] * m[(k << 2) + (j & 3)];
+			}
+			pmax = max(pmax, fabs(p[j]));
+		}
+		if (pmax == 0) break;
+		for (size_t j = 0; j < 16; ++j)
+		{
+			m[j] = p[j] / pmax;
+		}
+	}
+	size_t col = 0;
+	double col_sqr = 0;
+	for (size_t k = 0; k < 4; ++k)
+	{
+		const double v = m[k] * m[k] + m[4 + k] * m[4 + k] + m[8 + k] * m[8 + k] + m[12 + k] * m[12 + k];
+		if (v > col_sqr)
+		{
+			col = k;
+			col_sqr = v;
+		}
+	}
+	array<float, 4> q = {{ 1, 0, 0, 0 }};
+	if (col_sqr > 0)
+	{
+		const double inv = 1 / sqrt(col_sqr);
+		q = {{ static_cast<float>(m[col] * inv), static_cast<float>(m[4 + col] * inv), static_cast<float>(m[8 + col] * inv), static_cast<float>(m[12 + col] * inv) }};
+		q = normalize(q);
+	}
+
+	// Place the ROOT frame origin, which is at zero in the input conformation, so that the rotated centroid of the scaffold lands on the given one.
+	const array<float, 3> t = cb - qtn4_to_mat3(q) * ca;
+	org = {{ t[0], t[1], t[2], q[0], q[1], q[2], q[3] }};
+	return true;
 }
\ No newline at end of file
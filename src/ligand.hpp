@@ -19,13 +19,12 @@ public:
 	size_t rotorXidx; //!< Index pointing to the parent frame atom which forms a rotatable bond with the rotorY atom of current frame.
 	size_t rotorYidx; //!< Index pointing to the current frame atom which forms a rotatable bond with the rotorX atom of parent frame.
 	size_t childYidx; //!< The exclusive ending index to the heavy atoms of the current frame.
-	bool active; //!< Indicates if the current frame is active.
 	array<float, 3> yy; //!< Vector pointing from the origin of parent frame to the origin of current frame.
 	array<float, 3> xy; //!< Normalized vector pointing from rotor X of parent frame to rotor Y of current frame.
 	vector<size_t> branches; //!< Indexes to child branches.
 
-	//! Constructs an active frame, and relates it to its parent frame.
-	explicit frame(const size_t parent, const size_t rotorXsrn, const size_t rotorYsrn, const size_t rotorXidx, const size_t rotorYidx) : parent(parent), rotorXsrn(rotorXsrn), rotorYsrn(rotorYsrn), rotorXidx(rotorXidx), rotorYidx(rotorYidx), active(true) {}
+	//! Constructs a frame, and relates it to its parent frame.
+	explicit frame(const size_t parent, const size_t rotorXsrn, const size_t rotorYsrn, const size_t rotorXidx, const size_t rotorYidx) : parent(parent), rotorXsrn(rotorXsrn), rotorYsrn(rotorYsrn), rotorXidx(rotorXidx), rotorYidx(rotorYidx) {}
 
 	//! Outputs a BRANCH line in PDBQT format.
 	void output(boost::filesystem::ofstream& ofs) const;
@@ -36,17 +35,21 @@ class ligand
 {
 public:
 	path filename; //!< Filename of the input ligand.
-	vector<frame> frames; //!< ROOT and BRANCH frames.
+	vector<frame> frames; //!< ROOT and BRANCH frames, normalized for docking.
 	vector<atom> atoms; //!< Heavy atoms. Coordinates are relative to frame origin, which is the first atom by default. Hydrogens are saved under heavy atoms.
 	array<bool, scoring_function::n> xs; //!< Presence of XScore atom types.
-	size_t nv; //!< Number of variables to optimize, which equals 6 plus the number of active frames.
-	size_t nf; //!< Number of frames, both active and inactive.
+	size_t nv; //!< Number of variables to optimize, which equals 6 plus the number of BRANCH frames, i.e. nf - 1.
+	size_t nf; //!< Number of normalized frames, which are all active because frames of no effective torsion are folded into their parents.
 	size_t na; //!< Number of heavy atoms.
 	size_t np; //!< Number of non 1-4 interacting pairs.
+	size_t fingerprint; //!< Hash of the heavy-atom graph of the scaffold, i.e. the rings and their linkers, which analogs share.
+	vector<pair<size_t, size_t>> scaffold; //!< Refined labels and indexes of the heavy atoms of the scaffold, sorted by label so that atoms of equal labels correspond across analogs.
 	vector<float> affinities; //!< Binding affinities of predicted conformations.
+	vector<array<float, 3>> pose; //!< Heavy atom coordinates of the best conformation written.
 
 	//! Constructs a ligand by parsing a ligand file in PDBQT format.
-	explicit ligand(const path& p);
+	//! Inactive terminal frames are folded into their parents, and the frame tree is re-rooted at the frame of minimum maximum lever arm if reroot is true.
+	explicit ligand(const path& p, const bool reroot = false);
 
 	//! Encodes the current ligand into an array of integers.
 	void encode(int* const p) const;
@@ -54,6 +57,22 @@ public:
 	//! Writes conformations in PDBQT format to file.
 	void write(const float* const ex, const path& output_folder_path, const size_t max_conformations, const size_t num_tasks, const receptor& rec, const forest& f, const scoring_function& sf);
 
+	//! Loads the conformations of a previous run from the output folder, and returns their number of tasks, or 0 if they are absent or were docked with a different key.
+	size_t load(vector<float>& ex, const path& output_folder_path, const size_t receptor_key) const;
+
+	//! Saves the conformations of num_tasks tasks to the output folder for later top-up, keyed by the current ligand and the receptor key.
+	void save(const float* const ex, const path& output_folder_path, const size_t num_tasks, const size_t receptor_key) const;
+
+	//! Describes the input conformation in the layout of RF-Score features for surrogate triage, counting heavy atoms within 12A of each other in place of receptor atoms.
+	array<float, tree::nv> describe() const;
+
+	//! Calculates the centroids of the scaffold atoms of each label, in ascending order of label, from heavy atom coordinates.
+	vector<array<float, 3>> centroids(const vector<array<float, 3>>& c) const;
+
+	//! Fits the label centroids of the scaffold of the input conformation onto those of an analog by weighted least squares,
+	//! and returns the position and orientation of the ROOT frame in org, or false if the scaffolds do not correspond.
+	bool fit(array<float, 7>& org, const vector<array<float, 3>>& centroids) const;
+
 	//! Gets the number of elements of the current ligand.
 	size_t get_lig_elems() const;
 
@@ -62,7 +81,13 @@ public:
 
 	//! Gets the number of elements of a conformation.
 	size_t get_cnf_elems() const;
+
+	//! Gets the key under which conformations are compatible, i.e. the hash of the normalized frames and atoms combined with the receptor key.
+	size_t get_cnf_key(const size_t receptor_key) const;
 private:
+	//! Recovers the heavy atom coordinates of the input conformation, in which all the frames retain their input orientations and the ROOT frame origin is at zero.
+	vector<array<float, 3>> recover() const;
+
 	//! Represents a pair of interacting atoms that are separated by 3 consecutive covalent bonds.
 	class interacting_pair
 	{
@@ -76,6 +101,8 @@ private:
 	};
 
 	vector<interacting_pair> interacting_pairs; //!< Non 1-4 interacting pairs.
+	vector<frame> input_frames; //!< ROOT and BRANCH frames as parsed, indexing heavy atoms in the input order.
+	vector<size_t> input_order; //!< Indexes to the heavy atoms of the input order in the normalized order.
 };
 
 #endif
@@ -2,8 +2,12 @@
 #include <iostream>
 #include <iomanip>
 #include <numeric>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
 #include <boost/program_options.hpp>
 #include <boost/filesystem/operations.hpp>
+#include <boost/functional/hash.hpp>
 #include "io_service_pool.hpp"
 #include "safe_class.hpp"
 #include "random_forest.hpp"
@@ -11,13 +15,16 @@
 #include "ligand.hpp"
 #include "log.hpp"
 #include "kernel.hpp"
+#include "specializer.hpp"
 
 int main(int argc, char* argv[])
 {
-	path receptor_path, input_folder_path, output_folder_path, log_path;
+	path receptor_path, input_folder_path, output_folder_path, log_path, kernel_cache_path;
+	string kernel_compiler;
 	array<float, 3> center, size;
-	size_t seed, num_threads, num_trees, num_tasks, num_bfgs_iterations, max_conformations;
-	float granularity;
+	size_t seed, num_threads, num_trees, num_tasks, num_bfgs_iterations, max_conformations, max_in_flight, triage_random, triage_rounds, max_kernels;
+	float granularity, hessian_damping, triage_budget, hit_fraction, cluster_margin;
+	bool hessian_scaling, interpolation, reroot, top_up, cluster, warm_start;
 
 	// Parse program options in a try/catch block.
 	try
@@ -31,7 +38,16 @@ int main(int argc, char* argv[])
 		const size_t default_num_tasks = 256;
 		const size_t default_num_bfgs_iterations = 300;
 		const size_t default_max_conformations = 9;
+		const size_t default_max_in_flight = 4;
 		const  float default_granularity = 0.15625f;
+		const  float default_hessian_damping = 0.0f;
+		const  float default_triage_budget = 1.0f;
+		const size_t default_triage_random = 100;
+		const size_t default_triage_rounds = 5;
+		const  float default_hit_fraction = 0.01f;
+		const  float default_cluster_margin = 1.0f;
+		const string default_kernel_compiler = "c++ -std=c++11 -O2 -shared -fPIC";
+		const size_t default_max_kernels = 256;
 
 		// Set up options description.
 		using namespace boost::program_options;
@@ -59,7 +75,23 @@ int main(int argc, char* argv[])
 			("tasks", value<size_t>(&num_tasks)->default_value(default_num_tasks), "Monte Carlo tasks for global search")
 			("generations", value<size_t>(&num_bfgs_iterations)->default_value(default_num_bfgs_iterations), "generations in BFGS")
 			("max_conformations", value<size_t>(&max_conformations)->default_value(default_max_conformations), "maximum binding conformations to write")
+			("max_in_flight", value<size_t>(&max_in_flight)->default_value(default_max_in_flight), "maximum ligands docked but not yet written, beyond which docking waits for writing to catch up")
 			("granularity", value<float>(&granularity)->default_value(default_granularity), "density of probe atoms of grid maps")
+			("hessian_damping", value<float>(&hessian_damping)->default_value(default_hessian_damping), "weight in [0, 1) of the inverse Hessian carried over to the next generation, 0 to reset it")
+			("hessian_scaling", bool_switch(&hessian_scaling), "scale the initial inverse Hessian by the first curvature pair")
+			("interpolation", bool_switch(&interpolation), "interpolate step lengths in line search")
+			("reroot", bool_switch(&reroot), "re-root torsion trees at the frame of minimum lever arm")
+			("top_up", bool_switch(&top_up), "run additional tasks for ligands docked in output_folder by a previous run, and recluster all their conformations unless they were docked with a different ligand file, reroot, receptor or box")
+			("triage_budget", value<float>(&triage_budget)->default_value(default_triage_budget), "fraction in (0, 1] of ligands to dock, first at random and then as predicted promising by a surrogate random forest, 1 to dock all")
+			("triage_random", value<size_t>(&triage_random)->default_value(default_triage_random), "ligands of the triage budget to dock at random first, which train the surrogate random forest, at least 20")
+			("triage_rounds", value<size_t>(&triage_rounds)->default_value(default_triage_rounds), "batches to dock the rest of the triage budget in, retraining the surrogate random forest after each")
+			("hit_fraction", value<float>(&hit_fraction)->default_value(default_hit_fraction), "fraction in (0, 1) of top ligands regarded as hits, for the recall of triage and the threshold of scaffold clustering")
+			("cluster", bool_switch(&cluster), "dock a representative of each scaffold cluster first, and the other members only if it scores within cluster_margin of the running hit threshold")
+			("cluster_margin", value<float>(&cluster_margin)->default_value(default_cluster_margin), "margin in kcal/mol above the hit threshold within which a representative qualifies its cluster")
+			("warm_start", bool_switch(&warm_start), "start the cluster members with their scaffolds fitted onto that of the best conformation of their representative")
+			("kernel_cache", value<path>(&kernel_cache_path), "folder to cache kernels specialized for ligand topologies, compiled at runtime and used in place of the generic kernel. Docking waits while a topology absent from the folder compiles")
+			("kernel_compiler", value<string>(&kernel_compiler)->default_value(default_kernel_compiler), "command to compile specialized kernels into shared objects")
+			("max_kernels", value<size_t>(&max_kernels)->default_value(default_max_kernels), "maximum specialized kernels loaded at a time, beyond which the earliest loaded ones are unloaded")
 			("help", "help information")
 			("version", "version information")
 			("config", value<path>(), "configuration file to load options from")
@@ -95,6 +127,61 @@ int main(int argc, char* argv[])
 		// Notify the user of parsing errors, if any.
 		vm.notify();
 
+		// Validate max_in_flight.
+		if (!max_in_flight)
+		{
+			cerr << "Option max_in_flight must be positive" << endl;
+			return 1;
+		}
+
+		// Validate max_kernels.
+		if (!max_kernels)
+		{
+			cerr << "Option max_kernels must be positive" << endl;
+			return 1;
+		}
+
+		// Validate hessian_damping.
+		if (hessian_damping < 0 || hessian_damping >= 1)
+		{
+			cerr << "Option hessian_damping must be in [0, 1)" << endl;
+			return 1;
+		}
+
+		// Validate triage_budget, triage_random, triage_rounds and hit_fraction.
+		if (triage_budget <= 0 || triage_budget > 1)
+		{
+			cerr << "Option triage_budget must be in (0, 1]" << endl;
+			return 1;
+		}
+		if (triage_random < 20)
+		{
+			cerr << "Option triage_random must be at least 20, so that the trees of the surrogate random forest, which never split 5 samples or fewer, can split" << endl;
+			return 1;
+		}
+		if (!triage_rounds)
+		{
+			cerr << "Option triage_rounds must be positive" << endl;
+			return 1;
+		}
+		if (hit_fraction <= 0 || hit_fraction >= 1)
+		{
+			cerr << "Option hit_fraction must be in (0, 1)" << endl;
+			return 1;
+		}
+
+		// Validate cluster and warm_start.
+		if (cluster && triage_budget < 1)
+		{
+			cerr << "Options cluster and triage_budget are mutually exclusive" << endl;
+			return 1;
+		}
+		if (warm_start && !cluster)
+		{
+			cerr << "Option warm_start requires option cluster" << endl;
+			return 1;
+		}
+
 		// Validate receptor.
 		if (!is_regular_file(receptor_path))
 		{
@@ -109,6 +196,13 @@ int main(int argc, char* argv[])
 			return 1;
 		}
 
+		// Validate kernel_cache.
+		if (!kernel_cache_path.empty() && !exists(kernel_cache_path) && !create_directories(kernel_cache_path))
+		{
+			cerr << "Failed to create kernel cache folder " << kernel_cache_path << endl;
+			return 1;
+		}
+
 		// Validate output_folder.
 		if (exists(output_folder_path))
 		{
@@ -139,7 +233,7 @@ int main(int argc, char* argv[])
 
 	cout << "Creating an io service pool of " << num_threads << " worker threads" << endl;
 	io_service_pool io(num_threads);
-	safe_counter<size_t> cnt;
+	safe_counter<size_t> cnt, cnw;
 	safe_function safe_print;
 
 	cout << "Precalculating a scoring function of " << scoring_function::n << " atom types in parallel" << endl;
@@ -160,8 +254,23 @@ int main(int argc, char* argv[])
 	cout << "Parsing receptor " << receptor_path << endl;
 	receptor rec(receptor_path, center, size, granularity);
 
+	// Key the conformations saved for top-up by the receptor atoms and the box, so that those docked against another receptor or box are never merged.
+	size_t receptor_key = 0;
+	boost::hash_range(receptor_key, rec.corner0.cbegin(), rec.corner0.cend());
+	boost::hash_range(receptor_key, rec.corner1.cbegin(), rec.corner1.cend());
+	for (const atom& a : rec.atoms)
+	{
+		boost::hash_combine(receptor_key, a.xs);
+		boost::hash_range(receptor_key, a.coord.cbegin(), a.coord.cend());
+	}
+
 	vector<int>   ligh(2601);
-	vector<float> slnd(3438 * num_tasks);
+	vector<vector<float>> slnds(max_in_flight, vector<float>(3438 * num_tasks));
+	safe_vector<int> idle(max_in_flight); // Indices of the solution buffers not held by a docking ligand or its writer.
+	iota(idle.begin(), idle.end(), 0);
+	vector<int> nevs(num_tasks);
+	size_t num_evaluations = 0;
+	size_t num_optimizations = 0;
 
 	cout << "Training a random forest of " << num_trees << " trees in parallel" << endl;
 	forest f(num_trees, seed);
@@ -177,19 +286,144 @@ int main(int argc, char* argv[])
 	cnt.wait();
 	f.clear();
 
-	// Perform docking for each ligand in the input folder.
+	// Stream the ligands in the input folder.
+	const auto for_each_ligand = [&](const function<void(const path&)>& fn)
+	{
+		for (directory_iterator dir_iter(input_folder_path), const_dir_iter; dir_iter != const_dir_iter; ++dir_iter)
+		{
+			// Filter files with .pdbqt extension name.
+			if (dir_iter->path().extension() != ".pdbqt") continue;
+			fn(dir_iter->path());
+		}
+	};
+
+	// By default, the ligands are docked as they are streamed, so that memory does not grow with the library.
+	// Scaffold clustering collects the entire library to group it, whereas triage only counts it, and keeps the queued ligands alone.
+	vector<path> input_ligand_paths;
+	size_t num_ligands = 0;
+	if (cluster)
+	{
+		for_each_ligand([&](const path& p)
+		{
+			input_ligand_paths.push_back(p);
+		});
+		num_ligands = input_ligand_paths.size();
+	}
+	else if (triage_budget < 1)
+	{
+		for_each_ligand([&](const path&)
+		{
+			++num_ligands;
+		});
+	}
+
+	// For triage, queue a random batch of ligands to start with, selecting each streamed ligand with the probability of the remaining batch over the remaining library.
+	// The surrogate only picks the later batches, so a budget within the random batch is docked entirely at random.
+	const bool triage = triage_budget < 1 && num_ligands;
+	const size_t num_triage_ligands = triage ? max<size_t>(static_cast<size_t>(triage_budget * num_ligands + 0.5f), 1) : num_ligands;
+	const size_t num_random_ligands = min(triage_random, num_triage_ligands);
+	const size_t triage_batch = (num_triage_ligands - num_random_ligands + triage_rounds - 1) / triage_rounds;
+	size_t triage_round = 0;
+	const size_t triage_chunk = 4096; // Number of ligands described and predicted at a time, which bounds the memory of triage regardless of the library size.
+	vector<size_t> queue;
+	vector<array<float, tree::nv>> descriptors;
+	vector<float> energies(num_ligands);
+	float hit_energy = 0;
+	size_t num_random_hits = 0;
+	if (triage)
+	{
+		size_t num_streamed = 0;
+		for_each_ligand([&](const path& p)
+		{
+			if (num_streamed == num_ligands) return; // Ignore ligands added to the input folder after counting.
+			if (uniform_int_distribution<size_t>(0, num_ligands - ++num_streamed)(rng) < num_random_ligands - input_ligand_paths.size()) input_ligand_paths.push_back(p);
+		});
+		queue.resize(input_ligand_paths.size());
+		iota(queue.begin(), queue.end(), 0);
+		energies.resize(queue.size());
+		descriptors.resize(queue.size());
+	}
+
+	// Alternatively, queue a representative of each scaffold cluster to start with.
+	vector<vector<size_t>> clusters;
+	vector<size_t> representatives;
+	vector<size_t> ranked_clusters;
+	size_t next_cluster = 0;
+	const size_t num_top_hits = max<size_t>(static_cast<size_t>(hit_fraction * num_ligands), 1);
+	priority_queue<float> top_energies;
+	vector<vector<array<float, 3>>> anchors(warm_start ? num_ligands : 0);
+	if (cluster)
+	{
+		cout << "Fingerprinting " << num_ligands << " ligands in parallel for scaffold clustering" << endl;
+		vector<size_t> fingerprints(num_ligands), sizes(num_ligands);
+		cnt.init(num_ligands);
+		for (size_t l = 0; l < num_ligands; ++l)
+		{
+			io.post([&, l]()
+			{
+				const ligand lig(input_ligand_paths[l], reroot);
+				fingerprints[l] = lig.fingerprint;
+				sizes[l] = lig.na;
+				cnt.increment();
+			});
+		}
+		cnt.wait();
+
+		// Group the ligands by fingerprint, and represent each cluster by its smallest member, which is the closest to the bare scaffold.
+		unordered_map<size_t, size_t> indexes;
+		for (size_t l = 0; l < num_ligands; ++l)
+		{
+			const auto p = indexes.emplace(fingerprints[l], clusters.size());
+			if (p.second) clusters.emplace_back();
+			vector<size_t>& c = clusters[p.first->second];
+			c.push_back(l);
+			if (sizes[l] < sizes[c.front()]) swap(c.front(), c.back());
+		}
+		representatives.resize(num_ligands);
+		energies.resize(num_ligands);
+		queue.resize(clusters.size());
+		for (size_t i = 0; i < clusters.size(); ++i)
+		{
+			const vector<size_t>& c = clusters[i];
+			queue[i] = c.front();
+			for (const size_t l : c)
+			{
+				representatives[l] = c.front();
+			}
+		}
+	}
+	size_t batch_begin = 0;
+	cnw.init(queue.size());
+
+	// Perform docking for each queued ligand.
+	specializer spc(kernel_cache_path, kernel_compiler, max_kernels);
 	log_engine log;
+	const auto docking_begin = chrono::steady_clock::now();
 	cout.setf(ios::fixed, ios::floatfield);
 	cout << "Executing " << num_tasks << " optimization runs of " << num_bfgs_iterations << " BFGS iterations in parallel" << endl
 	     << "   Index        Ligand    pKd 1     2     3     4     5     6     7     8     9" << endl << setprecision(2);
-	for (directory_iterator dir_iter(input_folder_path), const_dir_iter; dir_iter != const_dir_iter; ++dir_iter)
+	directory_iterator dir_iter(input_folder_path), const_dir_iter;
+	for (size_t q = 0; ; ++q)
 	{
-		// Filter files with .pdbqt extension name.
-		const path& input_ligand_path = dir_iter->path();
-		if (input_ligand_path.extension() != ".pdbqt") continue;
+		// Take the next queued ligand for scaffold clustering or triage, or the next streamed ligand by default.
+		size_t l = q;
+		path input_ligand_path;
+		if (cluster || triage)
+		{
+			if (q == queue.size()) break;
+			input_ligand_path = input_ligand_paths[l = queue[q]];
+		}
+		else
+		{
+			// Filter files with .pdbqt extension name.
+			while (dir_iter != const_dir_iter && dir_iter->path().extension() != ".pdbqt") ++dir_iter;
+			if (dir_iter == const_dir_iter) break;
+			input_ligand_path = dir_iter->path();
+			++dir_iter;
+		}
 
 		// Parse the ligand. Don't declare it const as it will be moved to the callback data wrapper.
-		ligand lig(input_ligand_path);
+		ligand lig(input_ligand_path, reroot);
 
 		// Find atom types that are presented in the current ligand but not presented in the grid maps.
 		vector<size_t> xs;
@@ -231,8 +465,28 @@ int main(int argc, char* argv[])
 		// Encode the current ligand.
 		lig.encode(ligh.data());
 
-		// Reallocate slnd should the current solution elements exceed the default size.
-		const size_t this_sln_elems = lig.get_sln_elems() * num_tasks;
+		// Specialize the kernel for the topology of the current ligand if requested.
+		const evaluator evl = kernel_cache_path.empty() ? evaluate : spc(ligh.data(), lig.nf, lig.na, lig.np);
+
+		// Take an idle solution buffer, waiting for a writer to return one should max_in_flight ligands be docked but not yet written.
+		const int buf = idle.safe_pop_back();
+		vector<float>& slnd = slnds[buf];
+
+		// Load the conformations of a previous run to top up.
+		vector<float> cnfp;
+		const size_t num_prior_tasks = top_up ? lig.load(cnfp, output_folder_path, receptor_key) : 0;
+		if (top_up && !num_prior_tasks && exists(path(output_folder_path / lig.filename).replace_extension(".cnf")))
+		{
+			safe_print([&]()
+			{
+				cerr << "Ignoring the conformations of " << lig.filename << " docked with a different ligand file, reroot, receptor or box" << endl;
+			});
+		}
+
+		// Reallocate slnd should the current solution elements, or the conformations merged with the prior ones, exceed its size.
+		const size_t num_union_tasks = num_prior_tasks + num_tasks;
+		const size_t cnf_elems = lig.get_cnf_elems();
+		const size_t this_sln_elems = max(lig.get_sln_elems() * num_tasks, cnf_elems * num_union_tasks);
 		if (this_sln_elems > slnd.size())
 		{
 			slnd.resize(this_sln_elems);
@@ -241,26 +495,54 @@ int main(int argc, char* argv[])
 		// Clear the solution buffer.
 		slnd.assign(slnd.size(), 0);
 
-		// Launch kernel.
+		// Launch kernel, warm-starting a cluster member with its scaffold fitted onto the docked scaffold of its representative if requested.
+		array<float, 7> pose;
+		const float* const org = warm_start && representatives[l] != l && lig.fit(pose, anchors[representatives[l]]) ? pose.data() : nullptr;
 		cnt.init(num_tasks);
 		for (int gid = 0; gid < num_tasks; ++gid)
 		{
-			const size_t s = rng();
+			const size_t s = rng() ^ num_prior_tasks * 0x9e3779b97f4a7c15; // Mix in the number of prior tasks so that a top-up run of the same seed samples fresh streams.
 			io.post([&, s, gid]()
 			{
-				monte_carlo(slnd.data(), ligh.data(), lig.nv, lig.nf, lig.na, lig.np, s, num_bfgs_iterations, sf.e.data(), sf.d.data(), sf.ns, rec.corner0, rec.corner1, rec.num_probes, rec.granularity_inverse, rec.maps, gid, num_tasks);
+				nevs[gid] = monte_carlo(slnd.data(), ligh.data(), evl, lig.nv, lig.nf, lig.na, lig.np, s, org, num_bfgs_iterations, hessian_damping, hessian_scaling, interpolation, sf.e.data(), sf.d.data(), sf.ns, rec.corner0, rec.corner1, rec.num_probes, rec.granularity_inverse, rec.maps, gid, num_tasks);
 				cnt.increment();
 			});
 		}
 		cnt.wait();
 
-		// Reallocate cnfh should the current conformation elements exceed the default size.
-		const size_t this_cnf_elems = lig.get_cnf_elems() * num_tasks;
+		// Accumulate the number of evaluations. Each generation performs one local optimization.
+		num_evaluations += accumulate(nevs.cbegin(), nevs.cend(), static_cast<size_t>(0));
+		num_optimizations += num_tasks * num_bfgs_iterations;
+
+		// The leading elements of slnd are the current conformations. Merge the prior ones if any in place, both of which are strided by their numbers of tasks.
+		// Restride the current ones from the last element backwards, as each moves no earlier than it was, then fill the gaps with the prior ones.
+		if (num_prior_tasks)
+		{
+			for (size_t i = cnf_elems; i--;)
+			{
+				const auto src = slnd.begin() + num_tasks * i;
+				copy_backward(src, src + num_tasks, slnd.begin() + num_union_tasks * (i + 1));
+			}
+			for (size_t i = 0; i < cnf_elems; ++i)
+			{
+				copy_n(cnfp.cbegin() + num_prior_tasks * i, num_prior_tasks, slnd.begin() + num_union_tasks * i);
+			}
+		}
 
-		io.post(bind([&](ligand lig, vector<float> cnfh)
+		// Hand the solution buffer over to the writer, which returns it to the idle pool once written.
+		io.post(bind([&, l, buf](ligand lig, const size_t num_union_tasks)
 		{
-			// Write conformations.
-			lig.write(cnfh.data(), output_folder_path, max_conformations, num_tasks, rec, f, sf);
+			// Write conformations, and save them for later top-up.
+			const float* const cnfh = slnds[buf].data();
+			lig.write(cnfh, output_folder_path, max_conformations, num_union_tasks, rec, f, sf);
+			lig.save(cnfh, output_folder_path, num_union_tasks, receptor_key);
+			idle.safe_push_back(buf);
+
+			// Save the scaffold centroids of the best conformation of a representative to warm-start its cluster members.
+			if (warm_start && representatives[l] == l) anchors[l] = lig.centroids(lig.pose);
+
+			// Describe the ligand to train the surrogate of triage.
+			if (triage) descriptors[l] = lig.describe();
 
 			// Output and save ligand stem and predicted affinities.
 			safe_print([&]()
@@ -272,13 +554,159 @@ int main(int argc, char* argv[])
 					cout << setw(6) << a;
 				});
 				cout << endl;
+				if (cluster || triage) energies[l] = lig.affinities.front();
 				log.push_back(new log_record(move(stem), move(lig.affinities)));
 			});
-		}, move(lig), vector<float>(slnd.cbegin(), slnd.cbegin() + this_cnf_elems)));
+			cnw.increment();
+		}, move(lig), num_union_tasks));
+
+		// Once a batch has been docked and written, queue the next batch for scaffold clustering or triage.
+		if (!(cluster || triage) || q + 1 < queue.size()) continue;
+		cnw.wait();
+		const size_t b = q + 1 - batch_begin;
+		batch_begin = queue.size();
+		if (cluster)
+		{
+			// Keep the energies of the top hits docked so far, the highest of which is the running hit threshold.
+			for (size_t i = q + 1 - b; i <= q; ++i)
+			{
+				top_energies.push(energies[queue[i]]);
+				if (top_energies.size() > num_top_hits) top_energies.pop();
+			}
+
+			// Once the representatives have been docked, rank the clusters of multiple members by the energies of their representatives.
+			if (q + 1 == clusters.size())
+			{
+				for (size_t i = 0; i < clusters.size(); ++i)
+				{
+					if (clusters[i].size() > 1) ranked_clusters.push_back(i);
+				}
+				sort(ranked_clusters.begin(), ranked_clusters.end(), [&](const size_t i0, const size_t i1)
+				{
+					return energies[clusters[i0].front()] < energies[clusters[i1].front()];
+				});
+			}
+
+			// Queue the members of all the next clusters whose representatives score within the margin of the current hit threshold in one batch, so that the pipeline stays full.
+			// The threshold never increases, so no later cluster qualifies once one does not, and each queued cluster still qualifies against the threshold as of its queuing.
+			const float hit_threshold = top_energies.size() < num_top_hits ? numeric_limits<float>::max() : top_energies.top();
+			for (; next_cluster < ranked_clusters.size(); ++next_cluster)
+			{
+				const vector<size_t>& c = clusters[ranked_clusters[next_cluster]];
+				if (energies[c.front()] > hit_threshold + cluster_margin) break;
+				queue.insert(queue.end(), c.cbegin() + 1, c.cend());
+			}
+			cnw.init(queue.size() - batch_begin);
+			continue;
+		}
+		if (q < num_random_ligands)
+		{
+			// Estimate the hit energy from the random batch, which represents the entire library.
+			vector<float> e(b);
+			for (size_t i = 0; i < b; ++i)
+			{
+				e[i] = energies[queue[i]];
+			}
+			sort(e.begin(), e.end());
+			hit_energy = e[min(static_cast<size_t>(hit_fraction * b), b - 1)];
+		}
+		size_t num_hits = 0;
+		for (size_t i = q + 1 - b; i <= q; ++i)
+		{
+			num_hits += energies[queue[i]] <= hit_energy;
+		}
+		if (q < num_random_ligands) num_random_hits = num_hits;
+		cout << "Triage round " << ++triage_round << " docked " << b << " ligands, " << num_hits << " of which are hits of energy no higher than " << hit_energy << endl;
+		if (queue.size() == num_triage_ligands) continue;
+
+		// Train a surrogate random forest on the descriptors and energies of the docked ligands, which are all the queued ones.
+		forest surrogate(num_trees, rng());
+		cnt.init(num_trees);
+		for (size_t i = 0; i < num_trees; ++i)
+		{
+			io.post([&, i]()
+			{
+				surrogate[i].train(4, surrogate.u01_s, descriptors.data(), energies.data(), queue.size());
+				cnt.increment();
+			});
+		}
+		cnt.wait();
+		surrogate.clear();
+
+		// Stream the undocked ligands, describing and predicting them in parallel in chunks of bounded size,
+		// and keep those of the n lowest predictions in a max heap, breaking ties at random rather than by path.
+		const size_t n = min(triage_batch, num_triage_ligands - queue.size());
+		unordered_set<string> docked;
+		for (const path& p : input_ligand_paths)
+		{
+			docked.insert(p.string());
+		}
+		priority_queue<pair<pair<float, size_t>, path>> candidates;
+		vector<path> chunk;
+		vector<float> predictions(triage_chunk);
+		chunk.reserve(triage_chunk);
+		const auto predict = [&]()
+		{
+			cnt.init(chunk.size());
+			for (size_t i = 0; i < chunk.size(); ++i)
+			{
+				io.post([&, i]()
+				{
+					predictions[i] = surrogate(ligand(chunk[i], reroot).describe());
+					cnt.increment();
+				});
+			}
+			cnt.wait();
+			for (size_t i = 0; i < chunk.size(); ++i)
+			{
+				const pair<float, size_t> key(predictions[i], rng());
+				if (candidates.size() == n && key >= candidates.top().first) continue;
+				candidates.emplace(key, move(chunk[i]));
+				if (candidates.size() > n) candidates.pop();
+			}
+			chunk.clear();
+		};
+		for_each_ligand([&](const path& p)
+		{
+			if (docked.count(p.string())) return;
+			chunk.push_back(p);
+			if (chunk.size() == triage_chunk) predict();
+		});
+		predict();
+
+		// Queue the candidates.
+		for (; !candidates.empty(); candidates.pop())
+		{
+			queue.push_back(input_ligand_paths.size());
+			input_ligand_paths.push_back(candidates.top().second);
+		}
+		energies.resize(queue.size());
+		descriptors.resize(queue.size());
+		cnw.init(queue.size() - batch_begin);
 	}
 
 	// Wait until the io service pool has finished all its tasks.
 	io.wait();
+	assert(idle.size() == max_in_flight);
+
+	// Report the cost of local optimization, in wall time as well because evaluations of interpolating line search never exit early.
+	const float docking_seconds = chrono::duration<float>(chrono::steady_clock::now() - docking_begin).count();
+	if (num_optimizations) cout << "Performed " << num_evaluations << " evaluations in " << num_optimizations << " local optimizations, i.e. " << static_cast<float>(num_evaluations) / num_optimizations << " evaluations per local optimization, in " << docking_seconds << " seconds" << endl;
+
+	// Report the number of ligands docked by scaffold clustering.
+	if (cluster) cout << "Scaffold clustering docked " << queue.size() << " of " << num_ligands << " ligands in " << clusters.size() << " clusters" << endl;
+
+	// Report the recall of triage, estimating the number of hits in the library from the random batch.
+	if (triage)
+	{
+		const size_t num_hits = count_if(queue.cbegin(), queue.cend(), [&](const size_t l)
+		{
+			return energies[l] <= hit_energy;
+		});
+		// The library holds at least the hits recovered, so the estimate is bounded below by their number. Measure the true recall against a full run with utilities/triagerecall.
+		const float num_library_hits = max(static_cast<float>(num_random_hits) * num_ligands / num_random_ligands, static_cast<float>(num_hits));
+		cout << "Triage docked " << queue.size() << " of " << num_ligands << " ligands, recovering " << num_hits << " of an estimated " << num_library_hits << " hits, i.e. an estimated recall of " << (num_hits ? num_hits / num_library_hits : 0) << endl;
+	}
 
 	// Sort and write ligand log records to the log file.
 	if (log.empty()) return 0;
@@ -7,6 +7,11 @@ node::node() : children{}
 }
 
 void tree::train(const size_t mtry, const function<double()> u01)
+{
+	train(mtry, u01, x.data(), y.data(), ns);
+}
+
+void tree::train(const size_t mtry, const function<double()> u01, const array<float, nv>* const x, const float* const y, const size_t ns)
 {
 	// Create bootstrap samples with replacement.
 	reserve((ns << 1) - 1);
@@ -46,7 +51,7 @@ void tree::train(const size_t mtry, const function<double()> u01)
 			// Sort the samples in ascending order of the selected variable.
 			vector<size_t> ncase(n.samples.size());
 			iota(ncase.begin(), ncase.end(), 0);
-			sort(ncase.begin(), ncase.end(), [&n, v](const size_t val1, const size_t val2)
+			sort(ncase.begin(), ncase.end(), [&n, v, x](const size_t val1, const size_t val2)
 			{
 				return x[n.samples[val1]][v] < x[n.samples[val2]][v];
 			});
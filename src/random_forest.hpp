@@ -29,9 +29,12 @@ class tree : public vector<node>
 public:
 	static const size_t nv = 42; //!< Number of variables.
 
-	//! Trains an empty tree from bootstrap samples.
+	//! Trains an empty tree from bootstrap samples of the built-in training set.
 	void train(const size_t mtry, const function<double()> u01);
 
+	//! Trains an empty tree from bootstrap samples of a given training set of ns samples.
+	void train(const size_t mtry, const function<double()> u01, const array<float, nv>* const x, const float* const y, const size_t ns);
+
 	//! Predicts the y value of the given sample x.
 	float operator()(const array<float, nv>& x) const;
 
@@ -41,7 +41,7 @@ template <typename T>
 T safe_vector<T>::safe_pop_back()
 {
 	unique_lock<mutex> lock(m);
-	if (this->empty()) cv.wait(lock);
+	while (this->empty()) cv.wait(lock);
 	const T x = this->back();
 	this->pop_back();
 	return x;
@@ -0,0 +1,287 @@
+#include <iostream>
+#include <sstream>
+#include <set>
+#include <cstdlib>
+#include <boost/functional/hash.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+#ifndef _WIN32
+#include <dlfcn.h>
+#endif
+#include "specializer.hpp"
+
+//! Version of the generated code, which is hashed together with topologies so that stale shared objects are never loaded.
+static const size_t version = 3;
+
+//! Helpers of the generated code, performing the same floating point operations in the same order as the generic evaluator.
+static const char* const helpers = R"(#include <cmath>
+#include <array>
+#include <vector>
+using namespace std;
+
+// Look up the grid map for the free energy and its derivatives of an atom, penalizing out-of-box case.
+static inline void lookup(float& y, float* const d, const float c0, const float c1, const float c2, const float* const map, const array<float, 3>& cr0, const array<float, 3>& cr1, const array<int, 3>& npr, const float gri)
+{
+	if (c0 < cr0[0] || cr1[0] <= c0 || c1 < cr0[1] || cr1[1] <= c1 || c2 < cr0[2] || cr1[2] <= c2)
+	{
+		y += 10.0f;
+		d[0] = 0.0f;
+		d[1] = 0.0f;
+		d[2] = 0.0f;
+		return;
+	}
+	const int k0 = (int)((c0 - cr0[0]) * gri);
+	const int k1 = (int)((c1 - cr0[1]) * gri);
+	const int k2 = (int)((c2 - cr0[2]) * gri);
+	const int k = npr[0] * (npr[1] * k2 + k1) + k0;
+	const float e000 = map[k];
+	const float e100 = map[k + 1];
+	const float e010 = map[k + npr[0]];
+	const float e001 = map[k + npr[0] * npr[1]];
+	y += e000;
+	d[0] = (e100 - e000) * gri;
+	d[1] = (e010 - e000) * gri;
+	d[2] = (e001 - e000) * gri;
+}
+
+// Accumulate the intra-ligand free energy and derivatives of an interacting pair.
+static inline void interact(float& y, const float* const ci, const float* const ck, float* const di, float* const dk, const int p, const float* const sfe, const float* const sfd, const int sfs)
+{
+	const float v0 = ck[0] - ci[0];
+	const float v1 = ck[1] - ci[1];
+	const float v2 = ck[2] - ci[2];
+	const float vs = v0*v0 + v1*v1 + v2*v2;
+	if (vs < 64.0f)
+	{
+		const int j = p + (int)(sfs * vs);
+		y += sfe[j];
+		const float dr = sfd[j];
+		const float d0 = dr * v0;
+		const float d1 = dr * v1;
+		const float d2 = dr * v2;
+		di[0] -= d0;
+		di[1] -= d1;
+		di[2] -= d2;
+		dk[0] += d0;
+		dk[1] += d1;
+		dk[2] += d2;
+	}
+}
+
+)";
+
+//! Quotes a path as a single word of the POSIX shell.
+static string quote(const path& p)
+{
+	string q = "'";
+	for (const char c : p.string())
+	{
+		if (c == '\'') q += "'\\''";
+		else q += c;
+	}
+	return q + '\'';
+}
+
+specializer::specializer(const path& cache_folder_path, const string& compiler, const size_t capacity) : cache_folder_path(cache_folder_path), compiler(compiler), capacity(capacity)
+{
+}
+
+specializer::~specializer()
+{
+#ifndef _WIN32
+	for (const pair<size_t, void*>& h : handles)
+	{
+		if (h.second) dlclose(h.second);
+	}
+#endif
+}
+
+evaluator specializer::operator()(const int* const lig, const int nf, const int na, const int np)
+{
+	const int* const beg = &lig[nf]; // Skip the act flags, which are all set because normalization folds frames of no effective torsion.
+	const int* const end = &beg[nf];
+	const int* const nbr = &end[nf];
+	const int* const prn = &nbr[nf];
+	const int* const brs = &prn[7 * nf];
+	const int* const xst = &brs[nf - 1 + 3 * na];
+	const int* const ip0 = &xst[na];
+	const int* const ip1 = &ip0[np];
+	const int* const ipp = &ip1[np];
+
+	// Hash the topology, i.e. the encoded ligand except for the coordinates, which are loaded at runtime, together with the compiler command.
+	size_t h = version;
+	boost::hash_combine(h, compiler);
+	boost::hash_combine(h, nf);
+	boost::hash_combine(h, na);
+	boost::hash_combine(h, np);
+	boost::hash_range(h, beg, beg + 4 * nf);
+	boost::hash_range(h, brs, brs + nf - 1);
+	boost::hash_range(h, xst, xst + na + 3 * np);
+	const auto it = evaluators.find(h);
+	if (it != evaluators.cend()) return it->second;
+
+	// Unload the earliest loaded evaluator at capacity.
+	if (handles.size() == capacity)
+	{
+		evaluators.erase(handles.front().first);
+#ifndef _WIN32
+		if (handles.front().second) dlclose(handles.front().second);
+#endif
+		handles.pop_front();
+	}
+	evaluator& evl = evaluators[h] = evaluate;
+	handles.emplace_back(h, nullptr);
+#ifdef _WIN32
+	cerr << "Specialized kernels are not supported on Windows, falling back to the generic kernel" << endl;
+	return evl;
+#else
+	ostringstream stem;
+	stem << hex << h;
+	const path so_path = cache_folder_path / (stem.str() + ".so");
+	if (!exists(so_path))
+	{
+		// Generate straight-line code of the frame traversal, branch updates and interacting pairs.
+		// Coordinates, derivatives, orientations, forces and torques are kept in local arrays, as only e and g are read by the caller.
+		ostringstream s;
+		s << "// Kernel specialized for a ligand topology of " << nf << " frames, " << na << " heavy atoms and " << np << " interacting pairs.\n" << helpers
+		  << "extern \"C\" bool evaluate(float* e, float* g, float*, float*, float*, float*, float*, float*, const float* x, const int nf, const int na, const int np, const float eub, const int* shared, const float* sfe, const float* sfd, const int sfs, const array<float, 3> cr0, const array<float, 3> cr1, const array<int, 3> npr, const float gri, const vector<vector<float>>& mps, const int gid, const int gds)\n"
+		  << "{\n"
+		  << "\tconst float* const yy0 = (const float*)&shared[" << 5 * nf << "];\n"
+		  << "\tconst float* const yy1 = &yy0[" << nf << "];\n"
+		  << "\tconst float* const yy2 = &yy1[" << nf << "];\n"
+		  << "\tconst float* const xy0 = &yy2[" << nf << "];\n"
+		  << "\tconst float* const xy1 = &xy0[" << nf << "];\n"
+		  << "\tconst float* const xy2 = &xy1[" << nf << "];\n"
+		  << "\tconst float* const co0 = (const float*)&shared[" << 12 * nf - 1 << "];\n"
+		  << "\tconst float* const co1 = &co0[" << na << "];\n"
+		  << "\tconst float* const co2 = &co1[" << na << "];\n";
+		for (const int t : set<int>(xst, xst + na))
+		{
+			s << "\tconst float* const map" << t << " = mps[" << t << "].data();\n";
+		}
+		s << "\tfloat y, y0, y1, y2, c0, c1, c2, a0, a1, a2, ang, sng, r0, r1, r2, r3, f0, f1, f2, t0, t1, t2, d0, d1, d2, v0, v1, v2;\n"
+		  << "\tfloat q0, q1, q2, q3, q00, q01, q02, q03, q11, q12, q13, q22, q23, q33, m0, m1, m2, m3, m4, m5, m6, m7, m8;\n"
+		  << "\tfloat c[" << na << "][3], d[" << na << "][3], q[" << nf << "][4], a[" << nf << "][3], f[" << nf << "][3] = {}, t[" << nf << "][3] = {};\n"
+		  << "\n\t// Apply position, orientation and torsions.\n";
+		for (int j = 0; j < 7; ++j)
+		{
+			s << '\t' << (j < 3 ? "c[0][" : "q[0][") << (j < 3 ? j : j - 3) << "] = x[" << j << " * gds + gid];\n";
+		}
+		s << "\ty = 0.0f;\n";
+		int b = 0, w = 6;
+		for (int k = 0; k < nf; ++k)
+		{
+			s << "\n\t// Frame " << k << ".\n"
+			  << "\ty0 = c[" << beg[k] << "][0];\n"
+			  << "\ty1 = c[" << beg[k] << "][1];\n"
+			  << "\ty2 = c[" << beg[k] << "][2];\n"
+			  << "\tq0 = q[" << k << "][0];\n"
+			  << "\tq1 = q[" << k << "][1];\n"
+			  << "\tq2 = q[" << k << "][2];\n"
+			  << "\tq3 = q[" << k << "][3];\n"
+			  << "\tq00 = q0 * q0;\n\tq01 = q0 * q1;\n\tq02 = q0 * q2;\n\tq03 = q0 * q3;\n\tq11 = q1 * q1;\n\tq12 = q1 * q2;\n\tq13 = q1 * q3;\n\tq22 = q2 * q2;\n\tq23 = q2 * q3;\n\tq33 = q3 * q3;\n"
+			  << "\tm0 = q00 + q11 - q22 - q33;\n\tm1 = 2 * (q12 - q03);\n\tm2 = 2 * (q02 + q13);\n"
+			  << "\tm3 = 2 * (q03 + q12);\n\tm4 = q00 - q11 + q22 - q33;\n\tm5 = 2 * (q23 - q01);\n"
+			  << "\tm6 = 2 * (q13 - q02);\n\tm7 = 2 * (q01 + q23);\n\tm8 = q00 - q11 - q22 + q33;\n";
+			for (int i = beg[k]; i < end[k]; ++i)
+			{
+				if (i == beg[k])
+				{
+					s << "\tlookup(y, d[" << i << "], y0, y1, y2, map" << xst[i] << ", cr0, cr1, npr, gri);\n";
+					continue;
+				}
+				s << "\tv0 = co0[" << i << "];\n\tv1 = co1[" << i << "];\n\tv2 = co2[" << i << "];\n"
+				  << "\tc[" << i << "][0] = c0 = y0 + m0 * v0 + m1 * v1 + m2 * v2;\n"
+				  << "\tc[" << i << "][1] = c1 = y1 + m3 * v0 + m4 * v1 + m5 * v2;\n"
+				  << "\tc[" << i << "][2] = c2 = y2 + m6 * v0 + m7 * v1 + m8 * v2;\n"
+				  << "\tlookup(y, d[" << i << "], c0, c1, c2, map" << xst[i] << ", cr0, cr1, npr, gri);\n";
+			}
+			for (int j = 0; j < nbr[k]; ++j)
+			{
+				const int i = brs[b++];
+				s << "\tc[" << beg[i] << "][0] = y0 + m0 * yy0[" << i << "] + m1 * yy1[" << i << "] + m2 * yy2[" << i << "];\n"
+				  << "\tc[" << beg[i] << "][1] = y1 + m3 * yy0[" << i << "] + m4 * yy1[" << i << "] + m5 * yy2[" << i << "];\n"
+				  << "\tc[" << beg[i] << "][2] = y2 + m6 * yy0[" << i << "] + m7 * yy1[" << i << "] + m8 * yy2[" << i << "];\n";
+				s << "\ta[" << i << "][0] = a0 = m0 * xy0[" << i << "] + m1 * xy1[" << i << "] + m2 * xy2[" << i << "];\n"
+				  << "\ta[" << i << "][1] = a1 = m3 * xy0[" << i << "] + m4 * xy1[" << i << "] + m5 * xy2[" << i << "];\n"
+				  << "\ta[" << i << "][2] = a2 = m6 * xy0[" << i << "] + m7 * xy1[" << i << "] + m8 * xy2[" << i << "];\n"
+				  << "\tang = x[" << ++w << " * gds + gid] * 0.5f;\n"
+				  << "\tsng = sin(ang);\n\tr0 = cos(ang);\n\tr1 = sng * a0;\n\tr2 = sng * a1;\n\tr3 = sng * a2;\n"
+				  << "\tq[" << i << "][0] = r0 * q0 - r1 * q1 - r2 * q2 - r3 * q3;\n"
+				  << "\tq[" << i << "][1] = r0 * q1 + r1 * q0 + r2 * q3 - r3 * q2;\n"
+				  << "\tq[" << i << "][2] = r0 * q2 - r1 * q3 + r2 * q0 + r3 * q1;\n"
+				  << "\tq[" << i << "][3] = r0 * q3 + r1 * q2 - r2 * q1 + r3 * q0;\n";
+			}
+		}
+		s << "\n\t// Calculate intra-ligand free energy.\n";
+		for (int i = 0; i < np; ++i)
+		{
+			s << "\tinteract(y, c[" << ip0[i] << "], c[" << ip1[i] << "], d[" << ip0[i] << "], d[" << ip1[i] << "], " << ipp[i] << ", sfe, sfd, sfs);\n";
+		}
+		s << "\n\t// If the free energy is no better than the upper bound, refuse this conformation.\n"
+		  << "\te[gid] = y;\n"
+		  << "\tif (y >= eub) return false;\n";
+		for (int k = nf - 1; k >= 0; --k)
+		{
+			s << "\n\t// Aggregate frame " << k << ".\n"
+			  << "\tf0 = f[" << k << "][0];\n\tf1 = f[" << k << "][1];\n\tf2 = f[" << k << "][2];\n"
+			  << "\tt0 = t[" << k << "][0];\n\tt1 = t[" << k << "][1];\n\tt2 = t[" << k << "][2];\n"
+			  << "\ty0 = c[" << beg[k] << "][0];\n\ty1 = c[" << beg[k] << "][1];\n\ty2 = c[" << beg[k] << "][2];\n";
+			for (int i = beg[k]; i < end[k]; ++i)
+			{
+				s << "\td0 = d[" << i << "][0];\n\td1 = d[" << i << "][1];\n\td2 = d[" << i << "][2];\n"
+				  << "\tf0 += d0;\n\tf1 += d1;\n\tf2 += d2;\n";
+				if (i == beg[k]) continue;
+				s << "\tv0 = c[" << i << "][0] - y0;\n\tv1 = c[" << i << "][1] - y1;\n\tv2 = c[" << i << "][2] - y2;\n"
+				  << "\tt0 += v1 * d2 - v2 * d1;\n\tt1 += v2 * d0 - v0 * d2;\n\tt2 += v0 * d1 - v1 * d0;\n";
+			}
+			if (!k) continue;
+			s << "\tg[" << --w << " * gds + gid] = t0 * a[" << k << "][0] + t1 * a[" << k << "][1] + t2 * a[" << k << "][2];\n";
+			const int p = prn[k];
+			s << "\tf[" << p << "][0] += f0;\n\tf[" << p << "][1] += f1;\n\tf[" << p << "][2] += f2;\n"
+			  << "\tv0 = y0 - c[" << beg[p] << "][0];\n\tv1 = y1 - c[" << beg[p] << "][1];\n\tv2 = y2 - c[" << beg[p] << "][2];\n"
+			  << "\tt[" << p << "][0] += t0 + v1 * f2 - v2 * f1;\n"
+			  << "\tt[" << p << "][1] += t1 + v2 * f0 - v0 * f2;\n"
+			  << "\tt[" << p << "][2] += t2 + v0 * f1 - v1 * f0;\n";
+		}
+		s << "\n\t// Save the aggregated force and torque of ROOT frame to g.\n"
+		  << "\tg[0 * gds + gid] = f0;\n\tg[1 * gds + gid] = f1;\n\tg[2 * gds + gid] = f2;\n"
+		  << "\tg[3 * gds + gid] = t0;\n\tg[4 * gds + gid] = t1;\n\tg[5 * gds + gid] = t2;\n"
+		  << "\treturn true;\n"
+		  << "}\n";
+
+		// Compile a uniquely named source into a uniquely named shared object, and rename both so that concurrent processes never compile or load a partially written file.
+		const path src_path = cache_folder_path / unique_path(stem.str() + ".%%%%-%%%%.cpp");
+		const path tmp_path = cache_folder_path / unique_path(stem.str() + ".%%%%-%%%%.so");
+		{
+			boost::filesystem::ofstream ofs(src_path);
+			ofs << s.str();
+		}
+		boost::system::error_code ec;
+		if (system((compiler + " -o " + quote(tmp_path) + ' ' + quote(src_path)).c_str()))
+		{
+			cerr << "Failed to compile " << src_path << ", falling back to the generic kernel" << endl;
+			boost::filesystem::remove(tmp_path, ec);
+			return evl;
+		}
+		boost::filesystem::rename(tmp_path, so_path, ec);
+		if (ec) boost::filesystem::remove(tmp_path, ec);
+		boost::filesystem::rename(src_path, cache_folder_path / (stem.str() + ".cpp"), ec);
+		if (ec) boost::filesystem::remove(src_path, ec);
+	}
+
+	// Load the shared object and look up the specialized evaluator.
+	void* const handle = dlopen(so_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!handle)
+	{
+		cerr << "Failed to load " << so_path << ": " << dlerror() << ", falling back to the generic kernel" << endl;
+		return evl;
+	}
+	handles.back().second = handle;
+	if (void* const sym = dlsym(handle, "evaluate"))
+	{
+		evl = reinterpret_cast<evaluator>(sym);
+	}
+	return evl;
+#endif
+}
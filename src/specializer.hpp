@@ -0,0 +1,32 @@
+#pragma once
+#ifndef IDOCK_SPECIALIZER_HPP
+#define IDOCK_SPECIALIZER_HPP
+
+#include <unordered_map>
+#include <deque>
+#include <boost/filesystem/path.hpp>
+#include "kernel.hpp"
+using namespace boost::filesystem;
+
+//! Represents a cache of evaluators specialized for ligand topologies, which are generated in straight-line C++, compiled into shared objects at runtime and loaded dynamically.
+class specializer
+{
+public:
+	//! Constructs a specializer that caches shared objects in a folder, compiles them by a compiler command, and keeps at most capacity of them loaded.
+	explicit specializer(const path& cache_folder_path, const string& compiler, const size_t capacity);
+
+	//! Unloads the shared objects.
+	~specializer();
+
+	//! Returns the evaluator specialized for the topology of an encoded ligand, compiling it if it is not cached on disk, or the generic evaluator on failure.
+	//! Compilation blocks the caller. Loading a new topology at capacity unloads the earliest loaded one, so no evaluator previously returned may be running.
+	evaluator operator()(const int* const lig, const int nf, const int na, const int np);
+private:
+	const path cache_folder_path; //!< Folder of generated sources and compiled shared objects, named by the hash of topology and compiler command.
+	const string compiler; //!< Command to compile a source file into a shared object, followed by the quoted output and input file names.
+	const size_t capacity; //!< Maximum number of evaluators kept, including fallbacks to the generic evaluator.
+	unordered_map<size_t, evaluator> evaluators; //!< Evaluators kept, indexed by hash.
+	deque<pair<size_t, void*>> handles; //!< Hashes of the kept evaluators in the order of loading, and handles to their shared objects, or null for fallbacks.
+};
+
+#endif
@@ -0,0 +1,82 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+#include <boost/lexical_cast.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/filesystem/fstream.hpp>
+
+using std::string;
+using std::vector;
+using std::unordered_set;
+using boost::lexical_cast;
+using boost::filesystem::path;
+using boost::filesystem::ifstream;
+
+class record
+{
+public:
+	string ligand;
+	double energy;
+
+	explicit record(const string& line) : ligand(line.substr(0, line.find_first_of(','))), energy(lexical_cast<double>(line.substr(ligand.size() + 1, line.find_first_of(',', ligand.size() + 1) - ligand.size() - 1))) {}
+};
+
+inline bool operator<(const record& a, const record& b)
+{
+	return a.energy < b.energy;
+}
+
+// Read the records of a log.csv written by idock, skipping its header line.
+vector<record> read(const path& log_path)
+{
+	vector<record> records;
+	string line;
+	ifstream log(log_path);
+	getline(log, line);
+	while (getline(log, line))
+	{
+		records.push_back(record(line));
+	}
+	return records;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 4)
+	{
+		std::cout << "triagerecall full_log.csv triage_log.csv top_fraction\n"
+		          << "Measures the docking volume of a triage run and its true recall of the top ligands of a full run, i.e. one of --triage_budget 1, of the same library.\n";
+		return 1;
+	}
+
+	vector<record> full = read(argv[1]);
+	const vector<record> triage = read(argv[2]);
+	const double top_fraction = lexical_cast<double>(argv[3]);
+	if (full.empty())
+	{
+		std::cerr << "No records in " << argv[1] << '\n';
+		return 1;
+	}
+
+	// Take the top ligands of the full run as ground truth, and count those that the triage run docked.
+	unordered_set<string> docked;
+	for (const record& r : triage)
+	{
+		docked.insert(r.ligand);
+	}
+	std::sort(full.begin(), full.end());
+	const size_t k = std::max<size_t>(static_cast<size_t>(top_fraction * full.size() + 0.5), 1);
+	size_t num_recalled = 0;
+	for (size_t i = 0; i < k; ++i)
+	{
+		num_recalled += docked.count(full[i].ligand);
+	}
+
+	std::cout << std::fixed << std::setprecision(3)
+	          << "Triage docked " << triage.size() << " of " << full.size() << " ligands, i.e. a docking volume of " << static_cast<double>(triage.size()) / full.size() << " or a cut of " << static_cast<double>(full.size()) / triage.size() << "x\n"
+	          << "Triage recalled " << num_recalled << " of the top " << k << " ligands of the full run of energy no higher than " << full[k - 1].energy << ", i.e. a true recall of " << static_cast<double>(num_recalled) / k << '\n';
+	return 0;
+}